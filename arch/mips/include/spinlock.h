@@ -44,6 +44,10 @@ void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
 
+/* Atomic operations on pointers, for queue-based locks (mcslock.h) */
+void *spinlock_ptr_swap(void *volatile *p, void *val);
+bool spinlock_ptr_cas(void *volatile *p, void *oldval, void *newval);
+
 ////////////////////////////////////////////////////////////
 
 SPINLOCK_INLINE
@@ -93,5 +97,66 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+void *
+spinlock_ptr_swap(void *volatile *p, void *val)
+{
+	void *x;
+	void *y;
+
+	/*
+	 * Same LL/SC pair as testandset, but retried until the SC
+	 * goes through, since a swap can't pretend to have failed.
+	 */
+	do {
+		y = val;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (p) : "memory");
+	} while (y == 0);
+	return x;
+}
+
+SPINLOCK_INLINE
+bool
+spinlock_ptr_cas(void *volatile *p, void *oldval, void *newval)
+{
+	void *x;
+	void *y;
+
+	/*
+	 * Compare-and-swap using LL/SC: if *p is OLDVAL, store
+	 * NEWVAL. The store is skipped (leaving Y as 0) if the
+	 * loaded value doesn't match. Retry only if the SC itself
+	 * failed.
+	 */
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			".set noreorder;"	/* we fill the delay slot */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"bne %0, %3, 1f;"	/*   if (x != oldval) skip */
+			" move %1, $0;"		/*   y = 0 (delay slot) */
+			"move %1, %4;"		/*   y = newval */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y)
+			: "r" (p), "r" (oldval), "r" (newval)
+			: "memory");
+		if (x != oldval) {
+			return false;
+		}
+	} while (y == 0);
+	return true;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
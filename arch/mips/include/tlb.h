@@ -49,6 +49,13 @@
  *        was found. ENTRYLO is not actually used, but must be set; 0
  *        should be passed.
  *
+ *   tlb_setasid: make ASID the current address space ID.
+ *
+ * The current address space ID is the PID field of the EntryHi register,
+ * which all of the above except tlb_setasid clobber. Reset it with
+ * tlb_setasid afterwards unless the last EntryHi written had the right
+ * PID in it anyway.
+ *
  *        IMPORTANT NOTE: An entry may be matching even if the valid bit 
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
@@ -59,13 +66,14 @@ void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setasid(uint32_t asid);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
+ * The MIPS has support for a 6-bit address space ID: an entry only
+ * matches if its TLBHI_PID equals the PID currently in EntryHi, unless
+ * TLBLO_GLOBAL is set. We leave TLBLO_GLOBAL zero, as well as the
  * bits that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
@@ -78,7 +86,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -101,5 +110,16 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * tlb_random (tlbwr) only ever picks slots NUM_TLB_WIRED and up, so
+ * the ones below that are only changed by tlb_write.
+ */
+#define NUM_TLB_WIRED 8
+
+/*
+ * Number of address space IDs (values of TLBHI_PID).
+ */
+#define NUM_ASID 64
+
 
 #endif /* _MIPS_TLB_H_ */
@@ -110,6 +110,11 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS_nanosleep:
+		err = sys_nanosleep((userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
 #ifdef UW
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
@@ -141,6 +146,16 @@ syscall(struct trapframe *tf)
 	  break;
 #endif // UW
 
+	    case SYS_getpriority:
+		err = sys_getpriority((int)tf->tf_a0, (pid_t)tf->tf_a1,
+				      (int *)&retval);
+		break;
+
+	    case SYS_setpriority:
+		err = sys_setpriority((int)tf->tf_a0, (pid_t)tf->tf_a1,
+				      (int)tf->tf_a2);
+		break;
+
 	    /* Add stuff here */
 
 	default:
@@ -32,11 +32,19 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <cpu.h>
 #include <proc.h>
 #include <current.h>
+#include <uio.h>
+#include <vnode.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <swapfile.h>
+#include <uw-vmstats.h>
 
 #include "opt-A3.h"
 
@@ -54,131 +62,784 @@
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 #if OPT_A3
+/*
+ * Core map.
+ *
+ * vm_bootstrap() takes whatever physical memory ram_getsize() reports
+ * and tracks it here, one entry per frame. The map itself is stored in
+ * the first frames of that range, which are marked permanently in use.
+ *
+ * The first frame of every allocation records the length of the run so
+ * free_kpages() knows how many frames to give back. Free frames are
+ * also threaded on a doubly-linked free list (by frame index) so that
+ * single-page requests, which are by far the most common, are O(1).
+ * Multi-page requests still have to scan for a contiguous run.
+ *
+ * User pages can be shared copy-on-write between a parent and its
+ * children after fork, so run heads also carry a reference count; the
+ * run is only really freed when the last reference goes away.
+ *
+ * A user frame with a single reference also records which page it
+ * backs, so the evictor can find and update the page table entry.
+ * Kernel frames, shared frames and frames still being filled have no
+ * owner and are never evicted.
+ *
+ * When a shared frame drops back to one reference, nobody knows which
+ * address space holds it, and pages like the parent's text may never
+ * fault again to say. Fork keeps the layout, so every sharer maps it
+ * at the same vaddr; the frame keeps that, and is marked wasShared so
+ * the clock looks for the remaining mapping in each address space on
+ * allAddrspaces when it comes round (coremap_find_owner).
+ */
+struct coreMapEntry {
+	unsigned int runLength;	/* frames in the run starting here, 0 if not a run head */
+	unsigned int refCount;	/* references to the run, on the run head only */
+	bool inUse;		/* frame is allocated */
+	int prevFree;		/* free list links (frame indices, -1 terminates) */
+	int nextFree;
+	struct addrspace *owner;	/* address space the page belongs to, or NULL */
+	vaddr_t vaddr;		/* where the page is mapped in owner */
+	bool wasShared;		/* user frame with owner unknown since sharing */
+};
+
 paddr_t coreMapLo = 0;
 paddr_t coreMapHi = 0;
 bool vmBootStrapCalled = false;
 unsigned int coreMapSize = 0;
 
+static struct coreMapEntry *coreMap = NULL;
+static int coreMapFreeHead = -1;
+static unsigned int coreMapNumFree = 0;
+static unsigned int coreMapClockHand = 0;
+
 static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+/* All user address spaces. Taken inside coremap_lock. */
+static struct addrspace *allAddrspaces = NULL;
+static struct spinlock aslist_lock = SPINLOCK_INITIALIZER;
+
+#define COREMAP_INDEX(paddr)  (((paddr) - coreMapLo) / PAGE_SIZE)
+#define COREMAP_PADDR(index)  (coreMapLo + (paddr_t)(index) * PAGE_SIZE)
+
+/* Unlink frame INDEX from the free list. Caller holds coremap_lock. */
+static
+void
+coremap_unlink_free(int index)
+{
+	struct coreMapEntry *e = &coreMap[index];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(!e->inUse);
+
+	if (e->prevFree >= 0) {
+		coreMap[e->prevFree].nextFree = e->nextFree;
+	}
+	else {
+		KASSERT(coreMapFreeHead == index);
+		coreMapFreeHead = e->nextFree;
+	}
+	if (e->nextFree >= 0) {
+		coreMap[e->nextFree].prevFree = e->prevFree;
+	}
+	e->prevFree = e->nextFree = -1;
+	coreMapNumFree--;
+}
+
+/* Push frame INDEX on the head of the free list. Caller holds coremap_lock. */
+static
+void
+coremap_push_free(int index)
+{
+	struct coreMapEntry *e = &coreMap[index];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	e->inUse = false;
+	e->runLength = 0;
+	e->refCount = 0;
+	e->owner = NULL;
+	e->prevFree = -1;
+	e->nextFree = coreMapFreeHead;
+	if (coreMapFreeHead >= 0) {
+		coreMap[coreMapFreeHead].prevFree = index;
+	}
+	coreMapFreeHead = index;
+	coreMapNumFree++;
+}
+
+/*
+ * Find NPAGES contiguous free frames. Returns the index of the first
+ * one, or -1. Caller holds coremap_lock.
+ */
+static
+int
+coremap_find_run(unsigned long npages)
+{
+	unsigned int i, runStart, runLen;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (npages == 1) {
+		return coreMapFreeHead;
+	}
+	if (npages > coreMapNumFree) {
+		return -1;
+	}
+
+	runStart = 0;
+	runLen = 0;
+	for (i = 0; i < coreMapSize; i++) {
+		if (coreMap[i].inUse) {
+			runLen = 0;
+			continue;
+		}
+		if (runLen == 0) {
+			runStart = i;
+		}
+		runLen++;
+		if (runLen == npages) {
+			return runStart;
+		}
+	}
+	return -1;
+}
+
+/* Mark NPAGES frames starting at INDEX as one allocation. Caller holds coremap_lock. */
+static
+void
+coremap_take_run(int index, unsigned long npages)
+{
+	unsigned long i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (i = 0; i < npages; i++) {
+		coremap_unlink_free(index + i);
+		coreMap[index + i].inUse = true;
+		coreMap[index + i].runLength = 0;
+		coreMap[index + i].refCount = 0;
+		coreMap[index + i].owner = NULL;
+		coreMap[index + i].wasShared = false;
+	}
+	coreMap[index].runLength = npages;
+	coreMap[index].refCount = 1;
+}
+
+/*
+ * Paging.
+ *
+ * Anything that edits user page tables or moves pages between memory
+ * and swap holds paging_lock; that is what lets the evictor rewrite
+ * another process's page table entries. Eviction can be needed while
+ * it is already held (a page table allocation in vm_fault, say), so
+ * that path takes it recursively with paging_begin/paging_end.
+ */
+static struct lock *paging_lock = NULL;
+static bool evicting = false;
+
+static pte_t *pt_lookup(struct addrspace *as, vaddr_t vaddr, bool create);
+static void freeppages(paddr_t paddr);
+
+/* Acquire paging_lock unless we already hold it. Returns whether we took it. */
+static
+bool
+paging_begin(void)
+{
+	if (lock_do_i_hold(paging_lock)) {
+		return false;
+	}
+	lock_acquire(paging_lock);
+	return true;
+}
+
+static
+void
+paging_end(bool acquired)
+{
+	if (acquired) {
+		lock_release(paging_lock);
+	}
+}
+
+/*
+ * Frame INDEX was shared and is down to one reference: find the
+ * address space that still maps it at its vaddr and make that the
+ * owner. If none does yet (it is mid-way through a copy-on-write
+ * break, say), leave it for the next time round. Caller holds
+ * coremap_lock.
+ */
+static
+void
+coremap_find_owner(unsigned int index)
+{
+	struct coreMapEntry *e = &coreMap[index];
+	struct addrspace *as;
+	pte_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	spinlock_acquire(&aslist_lock);
+	for (as = allAddrspaces; as != NULL; as = as->as_next) {
+		pte = pt_lookup(as, e->vaddr, false);
+		if (pte != NULL && (*pte & PTE_VALID) &&
+		    (*pte & PTE_FRAME) == COREMAP_PADDR(index)) {
+			e->owner = as;
+			e->wasShared = false;
+			break;
+		}
+	}
+	spinlock_release(&aslist_lock);
+}
+
+/*
+ * Pick a frame to evict with the clock (second chance) algorithm.
+ * Pages used since the hand last passed lose their reference bit and
+ * are skipped this time round. Returns a frame index, or -1 if nothing
+ * can be evicted. Caller holds paging_lock.
+ */
+static
+int
+coremap_choose_victim(void)
+{
+	struct coreMapEntry *e;
+	unsigned int n, index;
+	pte_t *pte;
+
+	KASSERT(lock_do_i_hold(paging_lock));
+
+	spinlock_acquire(&coremap_lock);
+	for (n = 0; n < 2 * coreMapSize; n++) {
+		index = coreMapClockHand;
+		coreMapClockHand = (coreMapClockHand + 1) % coreMapSize;
+
+		e = &coreMap[index];
+		if (e->inUse && e->wasShared && e->refCount == 1) {
+			coremap_find_owner(index);
+		}
+		if (!e->inUse || e->owner == NULL || e->refCount != 1) {
+			continue;
+		}
+		KASSERT(e->runLength == 1);
+
+		pte = pt_lookup(e->owner, e->vaddr, false);
+		KASSERT(pte != NULL && (*pte & PTE_VALID));
+		KASSERT((*pte & PTE_FRAME) == COREMAP_PADDR(index));
+
+		if (*pte & PTE_REFERENCED) {
+			*pte &= ~PTE_REFERENCED;
+			continue;
+		}
+		spinlock_release(&coremap_lock);
+		return index;
+	}
+	spinlock_release(&coremap_lock);
+	return -1;
+}
+
+/*
+ * Free one user frame. Modified pages are written to swap first; clean
+ * ones are just dropped and will be refetched from the executable or
+ * zero-filled on their next fault. Caller holds paging_lock.
+ */
+static
+int
+vm_evict(void)
+{
+	struct tlbshootdown ts;
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	pte_t *pte, perms;
+	unsigned slot;
+	int index, result;
+
+	KASSERT(lock_do_i_hold(paging_lock));
+
+	index = coremap_choose_victim();
+	if (index < 0) {
+		return ENOMEM;
+	}
+	paddr = COREMAP_PADDR(index);
+	as = coreMap[index].owner;
+	vaddr = coreMap[index].vaddr;
+	pte = pt_lookup(as, vaddr, false);
+
+	/*
+	 * Unmap it everywhere before deciding whether it is modified:
+	 * only a writeable TLB entry could change it, and those are
+	 * only handed out once PTE_MODIFIED is set.
+	 */
+	*pte &= ~(PTE_VALID | PTE_DIRTY);
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	ipi_tlbshootdown_sync(&ts);
+
+	/* COW pages are private by now, so they just come back writeable. */
+	perms = (*pte & (PTE_WRITEABLE | PTE_COW)) ? PTE_WRITEABLE : 0;
+
+	if (*pte & PTE_MODIFIED) {
+		result = swap_alloc(&slot);
+		if (result == 0) {
+			result = swap_write(slot, paddr);
+			if (result) {
+				swap_free(slot);
+			}
+		}
+		if (result) {
+			*pte |= PTE_VALID;
+			return result;
+		}
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+		*pte = ((pte_t)slot << 12) | PTE_SWAPPED | perms;
+	}
+	else {
+		*pte = 0;
+	}
+
+	freeppages(paddr);
+	return 0;
+}
+
+/*
+ * Called when NPAGES frames can't be found. Evicts a page if that can
+ * help and it is safe to sleep here. Returns true if a frame was freed.
+ */
+static
+bool
+vm_make_room(unsigned long npages)
+{
+	bool acquired;
+	int result;
+
+	/* Freeing one frame can't be relied on to produce a longer run. */
+	if (npages != 1 || paging_lock == NULL) {
+		return false;
+	}
+	/*
+	 * Eviction may sleep on disk I/O. Holding a spinlock or mcslock
+	 * raises the IPL through splraise, which shows up in
+	 * t_iplhigh_count rather than t_curspl (e.g. proc_addthread
+	 * growing p_threads under p_lock); the caller gets ENOMEM.
+	 */
+	if (curthread->t_in_interrupt || curthread->t_curspl > 0 ||
+	    curthread->t_iplhigh_count > 0) {
+		return false;
+	}
+
+	acquired = paging_begin();
+	if (evicting) {
+		/* Writing a page out needed memory; don't recurse. */
+		paging_end(acquired);
+		return false;
+	}
+	evicting = true;
+	result = vm_evict();
+	evicting = false;
+	paging_end(acquired);
+
+	return result == 0;
+}
+#endif
+
+#if OPT_A3
+/*
+ * Address space IDs.
+ *
+ * TLB entries are tagged with the ASID of the address space that loaded
+ * them, so switching address spaces only means switching the current
+ * ASID rather than flushing the TLB. Each CPU hands out its own ASIDs;
+ * when it runs out it flushes its TLB and starts a new generation, and
+ * address spaces holding an ASID from an older generation get a fresh
+ * one the next time they run there. ASID 0 is never handed out.
+ *
+ * This state is only touched by its own CPU, with interrupts off.
+ */
+static uint32_t cpuAsidGen[MAXCPUS];
+static uint32_t cpuNextAsid[MAXCPUS];
+static uint32_t cpuCurAsid[MAXCPUS];
+
+/*
+ * Page directory of the address space current on each CPU, for the
+ * refill fast path in exception-mips1.S. Set along with the ASID.
+ */
+pte_t **vm_utlb_pagetables[MAXCPUS];
+
+/*
+ * TLB slots.
+ *
+ * Most refills never get here: mips_utlb_refill in exception-mips1.S
+ * loads resident, recently referenced pages straight from the page
+ * table with tlbwr, which only uses slots NUM_TLB_WIRED and up. vm_fault
+ * places the rest (first touches, pages the clock hand has passed,
+ * write faults) in the slots below that, which it manages itself.
+ *
+ * Rather than scanning with tlb_read for an empty slot on every miss,
+ * each CPU keeps a stack of the slots it knows to be empty; nothing
+ * else writes them, so it stays accurate. Once they are full, victims
+ * are picked round-robin, which unlike tlb_random never throws out the
+ * entry that was loaded last. The slot holding the most recently
+ * loaded stack page is pinned, since nearly every function call
+ * touches it.
+ *
+ * Like the ASID state, this is only touched by its own CPU, with
+ * interrupts off.
+ */
+struct tlbState {
+	unsigned numFree;		/* entries in freeSlots */
+	uint8_t freeSlots[NUM_TLB_WIRED];	/* slots holding no valid entry */
+	unsigned nextVictim;		/* round-robin replacement pointer */
+	int stackSlot;			/* pinned slot, or -1 */
+};
+
+static struct tlbState cpuTlb[MAXCPUS];
+
+/* Record that every slot in TS's TLB is empty. */
+static
+void
+vm_tlb_resetstate(struct tlbState *ts)
+{
+	unsigned i;
+
+	/* Stacked so that slot 0 is handed out first. */
+	for (i = 0; i < NUM_TLB_WIRED; i++) {
+		ts->freeSlots[i] = NUM_TLB_WIRED - 1 - i;
+	}
+	ts->numFree = NUM_TLB_WIRED;
+	ts->nextVictim = 0;
+	ts->stackSlot = -1;
+}
+
+/*
+ * Choose the slot for a new entry on this CPU. STACK says it is for a
+ * stack page, which makes it the pinned slot. Interrupts must be off.
+ */
+static
+int
+vm_tlb_slot(bool stack)
+{
+	struct tlbState *ts = &cpuTlb[curcpu->c_number];
+	int slot;
+
+	if (ts->numFree > 0) {
+		slot = ts->freeSlots[--ts->numFree];
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+	}
+	else {
+		do {
+			slot = ts->nextVictim;
+			ts->nextVictim = (ts->nextVictim + 1) % NUM_TLB_WIRED;
+		} while (slot == ts->stackSlot);
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+
+	if (stack) {
+		ts->stackSlot = slot;
+	}
+	return slot;
+}
+
+/* Invalidate SLOT in this CPU's TLB, putting it back on the free stack if it is ours. */
+static
+void
+vm_tlb_invalidate(int slot)
+{
+	struct tlbState *ts = &cpuTlb[curcpu->c_number];
+
+	tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+	if (slot >= NUM_TLB_WIRED) {
+		return;
+	}
+
+	KASSERT(ts->numFree < NUM_TLB_WIRED);
+	ts->freeSlots[ts->numFree++] = slot;
+	if (ts->stackSlot == slot) {
+		ts->stackSlot = -1;
+	}
+}
+
+/* Invalidate this CPU's whole TLB. Interrupts must be off. */
+static
+void
+vm_tlb_flush(void)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	vm_tlb_resetstate(&cpuTlb[curcpu->c_number]);
+	tlb_setasid(cpuCurAsid[curcpu->c_number]);
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+/*
+ * Make AS the current address space on this CPU, giving it an ASID
+ * here if it has none from the current generation. Returns the ASID.
+ * Interrupts must be off.
+ */
+static
+uint32_t
+vm_asid_activate(struct addrspace *as)
+{
+	unsigned cpu = curcpu->c_number;
+
+	KASSERT(cpu < MAXCPUS);
+
+	if (as->as_asidgen[cpu] != cpuAsidGen[cpu]) {
+		if (cpuNextAsid[cpu] == NUM_ASID) {
+			/* Out of ASIDs: everyone's entries here go. */
+			vm_tlb_flush();
+			cpuAsidGen[cpu]++;
+			cpuNextAsid[cpu] = 1;
+		}
+		as->as_asid[cpu] = cpuNextAsid[cpu]++;
+		as->as_asidgen[cpu] = cpuAsidGen[cpu];
+	}
+
+	cpuCurAsid[cpu] = as->as_asid[cpu];
+	vm_utlb_pagetables[cpu] = as->as_pagetable;
+	tlb_setasid(cpuCurAsid[cpu]);
+	return cpuCurAsid[cpu];
+}
+
+/*
+ * Give up AS's ASIDs on every CPU, which orphans any TLB entries it has
+ * anywhere at once: nobody is given those ASIDs again until the CPU has
+ * flushed its TLB for a new generation.
+ */
+static
+void
+as_retire_asids(struct addrspace *as)
+{
+	unsigned i;
+
+	for (i = 0; i < MAXCPUS; i++) {
+		as->as_asidgen[i] = 0;
+	}
+}
 #endif
-// Call ram_getsize to get the remaining physical memory in the system (THIS SHOULD NOT BE CALLED AGAIN)
-// Logically partition the memory into fixed sized frames -- each frame is PAGE_SIZE bytes
-// Keep track of the status of each frame (core-map data structure)
-		// This data structure should be stored in the start of the memory returned by ram_getsize
-		// The frames should start after the core-map data structure
-		// Should track which frames are used and available and keep track of contiguous memory allocations
-		// Consider adding info in the core-map to help determine number of pages that need to be freed
-				// If 4 contiguous frames were allocated using alloc_kpages then store 4 in the core-map entry for the start of the 4 frames
+
 void
 vm_bootstrap(void)
 {
 	#if OPT_A3
+	unsigned int i, mapPages;
 
-	// Tells your how much free physical memory there is -- needed for initializing structure for tracking which parts of physical memory are free
+	/* This hands us all remaining memory; it must only be called once. */
 	ram_getsize(&coreMapLo, &coreMapHi);
 	coreMapSize = (coreMapHi - coreMapLo) / PAGE_SIZE;
 
-	// Keep track of the status of each frame (core-map data structure)
-			// This data structure should be stored in the start of the memory returned by ram_getsize
-			// The frames should start after the core-map data structure
-			// Should track which frames are used and available and keep track of contiguous memory allocations
-			// Consider adding info in the core-map to help determine number of pages that need to be freed
-					// If 4 contiguous frames were allocated using alloc_kpages then store 4 in the core-map entry for the start of the 4 frames
-	for (int n = 0 ; n < coreMapSize ; n ++) {
-		// 
+	/* The core map lives at the start of the range it describes. */
+	coreMap = (struct coreMapEntry *)PADDR_TO_KVADDR(coreMapLo);
+	mapPages = DIVROUNDUP(coreMapSize * sizeof(struct coreMapEntry), PAGE_SIZE);
+	KASSERT(mapPages < coreMapSize);
+
+	spinlock_acquire(&coremap_lock);
+
+	coreMapFreeHead = -1;
+	coreMapNumFree = 0;
+
+	/*
+	 * Push in reverse so the free list hands out the lowest frames
+	 * first; that keeps early allocations packed together.
+	 */
+	for (i = coreMapSize; i-- > mapPages; ) {
+		coremap_push_free(i);
 	}
+	for (i = 0; i < mapPages; i++) {
+		coreMap[i].inUse = true;
+		coreMap[i].runLength = 0;
+		coreMap[i].refCount = 0;
+		coreMap[i].owner = NULL;
+		coreMap[i].wasShared = false;
+		coreMap[i].prevFree = coreMap[i].nextFree = -1;
+	}
+	coreMap[0].runLength = mapPages;
+	coreMap[0].refCount = 1;
 
 	vmBootStrapCalled = true;
+
+	spinlock_release(&coremap_lock);
+
+	vmstats_init();
+
+	for (i = 0; i < MAXCPUS; i++) {
+		cpuAsidGen[i] = 1;
+		cpuNextAsid[i] = 1;
+		cpuCurAsid[i] = 0;
+		vm_utlb_pagetables[i] = NULL;
+		/* start.S has already emptied the TLB with tlb_reset. */
+		vm_tlb_resetstate(&cpuTlb[i]);
+	}
+
+	paging_lock = lock_create("paging");
+	if (paging_lock == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+	swap_bootstrap();
 	#else
 	/* Do nothing. */
 	#endif
 }
 
-
-// Currently gets more page frames than needed
-// Two main limitations:
-		// 1) assumes each segment will be allocated contiguously in physical memory
-		// 2) never re-uses physical memory -- when a process exits the physical memory used
-				// to hold that process's address space doesn't become available for use by other processes
-				// as a result, the kernel will quickly run out of physical memory
-// Remove the above limitations, in particular:
-		// should be possible for pages in process'address spaces to be placed into any free frame of
-				// physical memory. the kernel should no longer require that address space segments be stored
-				// contiguously in physical memory
-		// when a process terminates, the physical frames that were used to hold its pages should be freed and
-				// become available to use by other processes
-// To implement the changes, the kernel will need some way of tracking where each page in each process' virtual
-		// address space is located and some way of keeping track of which frames of physical memory are free and which are in use
-// Kernel uses physical memory to hold its own data structures and to hold the address spaces of user processes
-		// kmalloc and kfree is used to dynamically allocate space for new kernel data structures
-		// They call alloc_kpages and free_kpages to allocate or free physical memory
-		// When you change the way kernel's physical memory management works, must also make that kmalloc and kfree also work
-				// No need to modify implementations of kmalloc or kfree
-		// Make sure that any physical pages freed by kfree becomes free and available for re-use by the kernel
-				// TODO: Requires the implementation of free_kpages
-// TODO: implement alloc_kpages
-// When kernel is bottings (before VM system is initialized) kernel will allocate memory for data structures
-		// When VM system is initialized make sure that it's aware that some parts of physical memory are already being used
-		// by the kernel, so it doesn't allocate that memory for other purposes
-
 static
 paddr_t
 getppages(unsigned long npages)
 {
 	#if OPT_A3
-	if (!vmBootStrapCalled) {
-		paddr_t addr;
+	paddr_t addr;
+	int index;
 
+	if (!vmBootStrapCalled) {
 		spinlock_acquire(&stealmem_lock);
 
 		addr = ram_stealmem(npages);
 
 		spinlock_release(&stealmem_lock);
 		return addr;
-	} else {
-		// If vm_bootstrap has been called, use the core-map instead of ram_stealmem
-		// This implementation needs to use the core map structure to find free pages
-		paddr_t addr;
-		for (int n = 0 ; n < coreMapSize ; n ++) {
-
-		}
-
-		// ------------ ram_stealmem code: ------------
-		// size_t size;
-		// paddr_t paddr;
-		//
-		// size = npages * PAGE_SIZE;
-		//
-		// if (firstpaddr + size > lastpaddr) {
-		// 	return 0;
-		// }
-		//
-		// paddr = firstpaddr;
-		// firstpaddr += size;
-		//
-		// return paddr;
+	}
 
-		return addr;
+	if (npages == 0) {
+		return 0;
 	}
 
+	for (;;) {
+		spinlock_acquire(&coremap_lock);
+		index = coremap_find_run(npages);
+		if (index >= 0) {
+			coremap_take_run(index, npages);
+			spinlock_release(&coremap_lock);
+			return COREMAP_PADDR(index);
+		}
+		spinlock_release(&coremap_lock);
 
+		if (!vm_make_room(npages)) {
+			return 0;
+		}
+	}
 
 	#else
 	paddr_t addr;
 
-	spinlock_acquire(&stealmem_lock);
+	spinlock_acquire(&stealmem_lock);
+
+	addr = ram_stealmem(npages);
+
+	spinlock_release(&stealmem_lock);
+	return addr;
+	#endif
+}
+
+#if OPT_A3
+/*
+ * Drop a reference to the run of frames starting at PADDR, and release
+ * the run if it was the last one. Memory stolen before vm_bootstrap()
+ * is not in the core map and is simply leaked, as before.
+ */
+static
+void
+freeppages(paddr_t paddr)
+{
+	unsigned int i, index, npages;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (!vmBootStrapCalled || paddr < coreMapLo || paddr >= coreMapHi) {
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	index = COREMAP_INDEX(paddr);
+	npages = coreMap[index].runLength;
+	if (!coreMap[index].inUse || npages == 0) {
+		panic("freeppages: 0x%x is not the start of an allocation\n",
+		      paddr);
+	}
+
+	KASSERT(coreMap[index].refCount > 0);
+	if (--coreMap[index].refCount > 0) {
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	/* Push in reverse so the run comes back out in address order. */
+	for (i = npages; i-- > 0; ) {
+		KASSERT(coreMap[index + i].inUse);
+		coremap_push_free(index + i);
+	}
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Add a reference to the single user frame at PADDR, which is mapped
+ * at VADDR in every address space sharing it.
+ */
+static
+void
+coremap_share(paddr_t paddr, vaddr_t vaddr)
+{
+	unsigned int index;
+
+	KASSERT(vmBootStrapCalled);
+	KASSERT(paddr >= coreMapLo && paddr < coreMapHi);
+
+	spinlock_acquire(&coremap_lock);
+	index = COREMAP_INDEX(paddr);
+	KASSERT(coreMap[index].inUse);
+	KASSERT(coreMap[index].runLength == 1);
+	coreMap[index].refCount++;
+	coreMap[index].owner = NULL;
+	coreMap[index].vaddr = vaddr;
+	coreMap[index].wasShared = true;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Record that the user frame at PADDR backs VADDR in AS, which makes it
+ * a candidate for eviction. Does nothing while the frame is shared.
+ */
+static
+void
+coremap_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned int index;
+
+	KASSERT(paddr >= coreMapLo && paddr < coreMapHi);
+
+	spinlock_acquire(&coremap_lock);
+	index = COREMAP_INDEX(paddr);
+	KASSERT(coreMap[index].inUse);
+	KASSERT(coreMap[index].runLength == 1);
+	if (coreMap[index].refCount == 1) {
+		coreMap[index].owner = as;
+		coreMap[index].vaddr = vaddr;
+		coreMap[index].wasShared = false;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/* Number of references to the single user frame at PADDR. */
+static
+unsigned int
+coremap_refcount(paddr_t paddr)
+{
+	unsigned int index, refCount;
+
+	KASSERT(vmBootStrapCalled);
+	KASSERT(paddr >= coreMapLo && paddr < coreMapHi);
 
-	addr = ram_stealmem(npages);
+	spinlock_acquire(&coremap_lock);
+	index = COREMAP_INDEX(paddr);
+	KASSERT(coreMap[index].inUse);
+	refCount = coreMap[index].refCount;
+	spinlock_release(&coremap_lock);
 
-	spinlock_release(&stealmem_lock);
-	return addr;
-	#endif
+	return refCount;
 }
+#endif
 
-
-// Called by kmalloc to allocate physical memory
-// Allocate frames for both kmalloc and address spaces
-// Frames need to be contiguous
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
 alloc_kpages(int npages)
@@ -191,15 +852,12 @@ alloc_kpages(int npages)
 	return PADDR_TO_KVADDR(pa);
 }
 
-
-// Free pages allocated with alloc_kpages
-// We don't specify how many pages to free, should free the same number of pages that was allocated
-// Update core-map to make frames available after free_kpages
 void
 free_kpages(vaddr_t addr)
 {
 	#if OPT_A3
-
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	freeppages(addr - MIPS_KSEG0);
 	#else
 	/* nothing - leak the memory. */
 
@@ -210,14 +868,42 @@ free_kpages(vaddr_t addr)
 void
 vm_tlbshootdown_all(void)
 {
+	#if OPT_A3
+	int spl;
+
+	spl = splhigh();
+	vm_tlb_flush();
+	splx(spl);
+	#else
 	panic("dumbvm tried to do tlb shootdown?!\n");
+	#endif
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
+	#if OPT_A3
+	struct addrspace *as = ts->ts_addrspace;
+	unsigned cpu = curcpu->c_number;
+	int i, spl;
+
+	spl = splhigh();
+
+	/* Without a current ASID here, it can't have live entries here. */
+	if (as->as_asidgen[cpu] == cpuAsidGen[cpu]) {
+		i = tlb_probe((ts->ts_vaddr & PAGE_FRAME) |
+			      (as->as_asid[cpu] << TLBHI_PIDSHIFT), 0);
+		if (i >= 0) {
+			vm_tlb_invalidate(i);
+		}
+		tlb_setasid(cpuCurAsid[cpu]);
+	}
+
+	splx(spl);
+	#else
 	(void)ts;
 	panic("dumbvm tried to do tlb shootdown?!\n");
+	#endif
 }
 
 
@@ -246,12 +932,252 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 		// When load_elf completes, flush the TLB and ensure that all future TLB entries for the text segment has TLBLO_DIRTY off
 
 
-// ------------- MEMORY MANAGEMENT ---------------
-// The kernel uses ram_stealmem when it needs to allocate more physical memory
-// The function ram_getsize is intended to be called when initialized new and improved virtual memory system (tells you how much free memory is available)
-		// Should only be called once when initializing the virtual memory system
-		// Once called, kernel should never call ram_getsize again to allocate physical memory -- should be calling the implemented function to allocate
+static
+void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
+
+#if OPT_A3
+/*
+ * Page tables.
+ *
+ * Every address space has a two-level table (see addrspace.h). The
+ * directory is allocated with the address space; second-level tables
+ * are allocated the first time a page in their 4M range is mapped.
+ */
+
+/*
+ * Return the page table entry for VADDR in AS. If CREATE is set the
+ * second-level table is allocated if missing; otherwise NULL is
+ * returned when there isn't one. Also returns NULL if out of memory.
+ */
+static
+pte_t *
+pt_lookup(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	pte_t *table;
+	unsigned l1;
+
+	KASSERT(as->as_pagetable != NULL);
+
+	l1 = PT_L1_INDEX(vaddr);
+	table = as->as_pagetable[l1];
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		table = kmalloc(PT_ENTRIES * sizeof(pte_t));
+		if (table == NULL) {
+			return NULL;
+		}
+		bzero(table, PT_ENTRIES * sizeof(pte_t));
+		as->as_pagetable[l1] = table;
+	}
+	return &table[PT_L2_INDEX(vaddr)];
+}
+
+/*
+ * Fill the frame at PADDR with the initial contents of user page VPAGE.
+ * Whatever part of the page is backed by the executable is read from
+ * it and the rest is zeroed. Sets *FROMFILE if anything was read.
+ *
+ * The read goes through the frame's kernel address, so it works for
+ * read-only pages and cannot itself take a TLB fault.
+ */
+static
+int
+as_load_page(struct addrspace *as, vaddr_t vpage, paddr_t paddr,
+	     bool *fromFile)
+{
+	struct segmentBacking *sb;
+	struct iovec iov;
+	struct uio u;
+	vaddr_t start, end;
+	unsigned i;
+	int result;
+
+	as_zero_region(paddr, 1);
+	*fromFile = false;
+
+	for (i = 0; i < as->as_nbacking; i++) {
+		sb = &as->as_backing[i];
+
+		start = vpage > sb->vaddr ? vpage : sb->vaddr;
+		end = vpage + PAGE_SIZE;
+		if (end > sb->vaddr + sb->fileSize) {
+			end = sb->vaddr + sb->fileSize;
+		}
+		if (start >= end) {
+			continue;
+		}
+
+		uio_kinit(&iov, &u,
+			  (void *)(PADDR_TO_KVADDR(paddr) + (start - vpage)),
+			  end - start, sb->offset + (start - sb->vaddr),
+			  UIO_READ);
+		result = VOP_READ(as->as_vnode, &u);
+		if (result) {
+			return result;
+		}
+		if (u.uio_resid != 0) {
+			kprintf("dumbvm: short read on segment - file truncated?\n");
+			return ENOEXEC;
+		}
+		*fromFile = true;
+	}
+	return 0;
+}
+
+/*
+ * First write to a copy-on-write page: give it a frame of its own
+ * unless nobody else is using the shared one any more, then make it
+ * writeable.
+ */
+static
+int
+as_break_cow(pte_t *pte)
+{
+	paddr_t oldFrame, newFrame;
+
+	KASSERT(*pte & PTE_VALID);
+	KASSERT(*pte & PTE_COW);
+
+	oldFrame = *pte & PTE_FRAME;
+	newFrame = oldFrame;
+
+	if (coremap_refcount(oldFrame) > 1) {
+		newFrame = getppages(1);
+		if (newFrame == 0) {
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(newFrame),
+			(const void *)PADDR_TO_KVADDR(oldFrame), PAGE_SIZE);
+		freeppages(oldFrame);
+	}
+
+	*pte = newFrame | (*pte & ~(PTE_FRAME | PTE_COW)) | PTE_WRITEABLE;
+	return 0;
+}
+
+/*
+ * Make the page at VADDR in AS resident and usable for FAULTTYPE,
+ * bringing it in from swap or the executable, or zero-filling it, as
+ * needed. READONLY says whether the region may be written. Hands back
+ * the page table entry in *RET. Called with paging_lock held.
+ */
+static
+int
+as_fault(struct addrspace *as, int faulttype, vaddr_t vaddr, bool readOnly,
+	 pte_t **ret)
+{
+	pte_t *pte;
+	paddr_t paddr;
+	bool fromFile;
+	int result;
+
+	KASSERT(lock_do_i_hold(paging_lock));
+
+	pte = pt_lookup(as, vaddr, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	if (faulttype == VM_FAULT_READONLY && (*pte & PTE_VALID) == 0) {
+		/* Evicted after the exception was taken. */
+		faulttype = VM_FAULT_WRITE;
+	}
+
+	if (*pte & PTE_VALID) {
+		if (faulttype != VM_FAULT_READONLY) {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+	}
+	else if (*pte & PTE_SWAPPED) {
+		paddr = getppages(1);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = swap_read(PTE_SLOT(*pte), paddr);
+		if (result) {
+			freeppages(paddr);
+			return result;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+
+		/* The swap copy is given up, so this has to be written back again. */
+		swap_free(PTE_SLOT(*pte));
+		*pte = paddr | PTE_VALID | PTE_MODIFIED;
+		if (!readOnly) {
+			*pte |= PTE_WRITEABLE;
+		}
+	}
+	else {
+		paddr = getppages(1);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+
+		/*
+		 * Reading the executable can block in the file system,
+		 * whose locks may be held by threads waiting to fault, so
+		 * let go of paging_lock meanwhile. Nothing else touches
+		 * this entry: the process is ours, and the new frame has no
+		 * owner yet so the evictor leaves it alone.
+		 */
+		lock_release(paging_lock);
+		result = as_load_page(as, vaddr, paddr, &fromFile);
+		lock_acquire(paging_lock);
+		if (result) {
+			freeppages(paddr);
+			return result;
+		}
+		KASSERT((*pte & PTE_VALID) == 0);
+
+		*pte = paddr | PTE_VALID;
+		if (!readOnly) {
+			*pte |= PTE_WRITEABLE;
+		}
+
+		if (fromFile) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+			vmstats_inc(VMSTAT_ELF_FILE_READ);
+		}
+		else {
+			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		}
+	}
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+
+	/*
+	 * Writeable pages are mapped read-only until they are first
+	 * written, which is how PTE_MODIFIED gets set. Writes to shared
+	 * pages are resolved here too, rather than loading a read-only
+	 * entry and faulting again straight away.
+	 */
+	if (faulttype != VM_FAULT_READ) {
+		if ((*pte & PTE_WRITEABLE) == 0) {
+			if ((*pte & PTE_COW) == 0) {
+				return EFAULT;
+			}
+			result = as_break_cow(pte);
+			if (result) {
+				return result;
+			}
+		}
+		*pte |= PTE_DIRTY | PTE_MODIFIED;
+	}
+	*pte |= PTE_REFERENCED;
 
+	coremap_claim(*pte & PTE_FRAME, as, vaddr);
+	*ret = pte;
+	return 0;
+}
+#endif
 
 // -------------- HANDLING TLB FAULTS ---------------
 // Make sure the TLB handler (vm_fault) doesn't cause another TLB fault -- should avoid anything that involves touching virtual addresses
@@ -262,9 +1188,10 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
 	int i;
-	uint32_t ehi, elo;
+	uint32_t elo;
 	struct addrspace *as;
 	int spl;
+	bool readOnly = false;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -272,8 +1199,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
+		#if OPT_A3
+		/* A write to a page mapped read-only; may be copy-on-write. */
+		break;
+		#else
 				/* We always create pages read-write, so we can't get this */
 				return EFAULT;
+		#endif
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -299,19 +1231,18 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+	#if OPT_A3
+	pte_t *pte;
+	uint32_t vpage;
+	bool isStack = false;
+	int result;
+
 	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_pagetable != NULL);
 	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
 	KASSERT(as->as_npages1 != 0);
 	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
 	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
 
 	vbase1 = as->as_vbase1;
 	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
@@ -320,25 +1251,51 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
 
-
-	#if OPT_A3
-	bool loadElfStatus = as->load_elf_done;
-	bool isTextSegment = false;
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-		isTextSegment = true;
+		/* The text segment becomes read-only once it is loaded. */
+		readOnly = as->load_elf_done;
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
 	}
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
+		isStack = true;
 	}
 	else {
 		return EFAULT;
 	}
 
+	/* Held until the TLB is loaded; see below. */
+	lock_acquire(paging_lock);
+	result = as_fault(as, faulttype, faultaddress, readOnly, &pte);
+	if (result) {
+		lock_release(paging_lock);
+		return result;
+	}
+	paddr = *pte & PTE_FRAME;
+	readOnly = (*pte & PTE_DIRTY) == 0;
+
 	#else
+	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_vbase1 != 0);
+	KASSERT(as->as_pbase1 != 0);
+	KASSERT(as->as_npages1 != 0);
+	KASSERT(as->as_vbase2 != 0);
+	KASSERT(as->as_pbase2 != 0);
+	KASSERT(as->as_npages2 != 0);
+	KASSERT(as->as_stackpbase != 0);
+	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
+	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
+	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
+	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
+	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
+
+	vbase1 = as->as_vbase1;
+	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
+	vbase2 = as->as_vbase2;
+	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	stacktop = USERSTACK;
+
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
 	}
@@ -359,6 +1316,33 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	#if OPT_A3
+	/*
+	 * Once interrupts are off the lock can go: if the page is evicted
+	 * now, the shootdown IPI can't be taken until the entry we are
+	 * about to load is in the TLB, so it gets removed again.
+	 */
+	lock_release(paging_lock);
+
+	/* Writing VPAGE to EntryHi below also leaves the right ASID current. */
+	vpage = faultaddress | (vm_asid_activate(as) << TLBHI_PIDSHIFT);
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	if (readOnly) {
+		elo &= ~TLBLO_DIRTY;
+	}
+
+	/* Replace a stale read-only entry in place; never load duplicates. */
+	i = tlb_probe(vpage, 0);
+	if (i < 0) {
+		i = vm_tlb_slot(isStack);
+	}
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tlb_write(vpage, elo, i);
+	splx(spl);
+	return 0;
+	#else
+	uint32_t ehi;
+
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_read(&ehi, &elo, i);
 		if (elo & TLBLO_VALID) {
@@ -366,7 +1350,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		if (isTextSegment && loadElfStatus) {
+		if (readOnly) {
 			elo &= ~TLBLO_DIRTY;
 		}
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
@@ -380,12 +1364,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			// Make sure that virtual page fields in the TLB are unique
 	ehi = faultaddress;
 	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	if (isTextSegment && loadElfStatus) {
+	if (readOnly) {
 		elo &= ~TLBLO_DIRTY;
 	}
 	tlb_random(ehi, elo);
 	splx(spl);
 	return 0;
+	#endif
 }
 
 struct addrspace *
@@ -396,16 +1381,27 @@ as_create(void)
 		return NULL;
 	}
 
-
 	#if OPT_A3
+	as->as_pagetable = kmalloc(PT_ENTRIES * sizeof(pte_t *));
+	if (as->as_pagetable == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	bzero(as->as_pagetable, PT_ENTRIES * sizeof(pte_t *));
+
 	as->as_vbase1 = 0;
-	// as->as_pbase1 = 0;
 	as->as_npages1 = 0;
 	as->as_vbase2 = 0;
-	// as->as_pbase2 = 0;
 	as->as_npages2 = 0;
-	// as->as_stackpbase = 0;
+	as->as_vnode = NULL;
+	as->as_nbacking = 0;
+	as_retire_asids(as);
 	as->load_elf_done = false;
+
+	spinlock_acquire(&aslist_lock);
+	as->as_next = allAddrspaces;
+	allAddrspaces = as;
+	spinlock_release(&aslist_lock);
 	#else
 	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
@@ -424,8 +1420,49 @@ void
 as_destroy(struct addrspace *as)
 {
 	#if OPT_A3
+	struct addrspace **asp;
+	pte_t *table;
+	unsigned i, j;
+	bool acquired;
+
+	/* Keep coremap_find_owner away from our page tables. */
+	spinlock_acquire(&aslist_lock);
+	for (asp = &allAddrspaces; *asp != as; asp = &(*asp)->as_next) {
+		KASSERT(*asp != NULL);
+	}
+	*asp = as->as_next;
+	spinlock_release(&aslist_lock);
+
+	/* Don't let the refill fast path walk tables that are going away. */
+	for (i = 0; i < MAXCPUS; i++) {
+		if (vm_utlb_pagetables[i] == as->as_pagetable) {
+			vm_utlb_pagetables[i] = NULL;
+		}
+	}
 
+	/* Keep the evictor away from our frames while they go. */
+	acquired = paging_begin();
+	for (i = 0; i < PT_ENTRIES; i++) {
+		table = as->as_pagetable[i];
+		if (table == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_ENTRIES; j++) {
+			if (table[j] & PTE_VALID) {
+				freeppages(table[j] & PTE_FRAME);
+			}
+			else if (table[j] & PTE_SWAPPED) {
+				swap_free(PTE_SLOT(table[j]));
+			}
+		}
+		kfree(table);
+	}
+	kfree(as->as_pagetable);
+	paging_end(acquired);
 
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
 	kfree(as);
 	#else
 	kfree(as);
@@ -435,7 +1472,7 @@ as_destroy(struct addrspace *as)
 void
 as_activate(void)
 {
-	int i, spl;
+	int spl;
 	struct addrspace *as;
 
 	as = curproc_getas();
@@ -449,9 +1486,16 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	#if OPT_A3
+	/* No flush: entries of other address spaces carry other ASIDs. */
+	vm_asid_activate(as);
+	#else
+	int i;
+
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+	#endif
 
 	splx(spl);
 }
@@ -501,16 +1545,14 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return EUNIMP;
 }
 
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
-
 int
 as_prepare_load(struct addrspace *as)
 {
+	#if OPT_A3
+	/* Nothing to allocate up front; vm_fault does it page by page. */
+	KASSERT(as->as_pagetable != NULL);
+	return 0;
+	#else
 	KASSERT(as->as_pbase1 == 0);
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
@@ -535,7 +1577,42 @@ as_prepare_load(struct addrspace *as)
 	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
 
 	return 0;
+	#endif
+}
+
+#if OPT_A3
+int
+as_define_backing(struct addrspace *as, struct vnode *v,
+		  off_t offset, vaddr_t vaddr, size_t memsize, size_t filesize)
+{
+	struct segmentBacking *sb;
+
+	KASSERT(filesize <= memsize);
+
+	/* Nothing checks the destination at load time any more; do it here. */
+	if (vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP) {
+		return ENOEXEC;
+	}
+	if (filesize == 0) {
+		return 0;
+	}
+	if (as->as_nbacking == AS_NBACKING) {
+		kprintf("dumbvm: Warning: too many file-backed segments\n");
+		return EUNIMP;
+	}
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	sb = &as->as_backing[as->as_nbacking++];
+	sb->vaddr = vaddr;
+	sb->fileSize = filesize;
+	sb->offset = offset;
+	return 0;
 }
+#endif
 
 int
 as_complete_load(struct addrspace *as)
@@ -547,12 +1624,79 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+	#if OPT_A3
+	KASSERT(as->as_pagetable != NULL);
+	#else
 	KASSERT(as->as_stackpbase != 0);
+	#endif
 
 	*stackptr = USERSTACK;
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Give NEW the pages of OLD. Resident pages are shared: writeable ones
+ * become read-only copy-on-write in both address spaces, and whichever
+ * side writes first gets its own copy in vm_fault. Swap slots are not
+ * shared, so swapped-out pages are read into a private frame for NEW.
+ * Called with paging_lock held.
+ */
+static
+int
+as_share_pages(struct addrspace *old, struct addrspace *new)
+{
+	pte_t *table, *pte;
+	paddr_t paddr;
+	unsigned i, j;
+	int result;
+
+	KASSERT(lock_do_i_hold(paging_lock));
+
+	for (i = 0; i < PT_ENTRIES; i++) {
+		table = old->as_pagetable[i];
+		if (table == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_ENTRIES; j++) {
+			if (table[j] == 0) {
+				continue;
+			}
+			pte = pt_lookup(new, PT_VADDR(i, j), true);
+			if (pte == NULL) {
+				return ENOMEM;
+			}
+
+			if (table[j] & PTE_VALID) {
+				if (table[j] & PTE_WRITEABLE) {
+					table[j] &= ~(PTE_WRITEABLE | PTE_DIRTY);
+					table[j] |= PTE_COW;
+				}
+				coremap_share(table[j] & PTE_FRAME,
+					      PT_VADDR(i, j));
+				*pte = table[j];
+				continue;
+			}
+
+			KASSERT(table[j] & PTE_SWAPPED);
+			paddr = getppages(1);
+			if (paddr == 0) {
+				return ENOMEM;
+			}
+			result = swap_read(PTE_SLOT(table[j]), paddr);
+			if (result) {
+				freeppages(paddr);
+				return result;
+			}
+			*pte = paddr | PTE_VALID | PTE_MODIFIED |
+				(table[j] & PTE_WRITEABLE);
+			coremap_claim(paddr, new, PT_VADDR(i, j));
+		}
+	}
+	return 0;
+}
+#endif
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -568,6 +1712,36 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
 
+	#if OPT_A3
+	int result;
+
+	new->load_elf_done = old->load_elf_done;
+
+	/* Pages the parent never touched still come from the executable. */
+	new->as_nbacking = old->as_nbacking;
+	memcpy(new->as_backing, old->as_backing, sizeof(old->as_backing));
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+
+	lock_acquire(paging_lock);
+	result = as_share_pages(old, new);
+	lock_release(paging_lock);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	/*
+	 * The parent may still have writeable TLB entries for these pages,
+	 * on any CPU it has run on. Drop them all by giving up its ASIDs.
+	 */
+	as_retire_asids(old);
+	if (old == curproc_getas()) {
+		as_activate();
+	}
+	#else
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
 	if (as_prepare_load(new)) {
 		as_destroy(new);
@@ -589,6 +1763,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+	#endif
 
 	*ret = new;
 	return 0;
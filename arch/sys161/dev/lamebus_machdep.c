@@ -242,6 +242,24 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Tickless idle. The on-chip timer can't be switched off, so park
+ * c_compare as far out as it goes: 2^32 cycles is nearly three
+ * minutes at CPU_FREQUENCY, and if it does fire the interrupt
+ * handler just puts the normal tick back.
+ */
+void
+mainbus_tick_stop(void)
+{
+	mips_timer_set(0xffffffff);
+}
+
+void
+mainbus_tick_start(void)
+{
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -36,9 +36,65 @@
 
 
 #include <vm.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <platform/maxcpus.h>
+#endif
 
 struct vnode;
 
+#if OPT_A3
+/*
+ * Page table entries.
+ *
+ * The layout matches the MIPS TLB EntryLo register (frame number in the
+ * top 20 bits, then the dirty and valid bits), so a resident entry can
+ * be turned into a TLB entry by masking with PTE_TLBBITS. The low bits,
+ * which the hardware ignores, are used for software state.
+ *
+ * An entry that is not PTE_VALID is either untouched (its contents come
+ * from the executable or are zero), or PTE_SWAPPED with its contents in
+ * the swap slot held in the frame field.
+ */
+typedef uint32_t pte_t;
+
+#define PTE_FRAME      0xfffff000	/* physical frame, or swap slot if PTE_SWAPPED */
+#define PTE_DIRTY      0x00000400	/* TLB allows writes (TLBLO_DIRTY) */
+#define PTE_VALID      0x00000200	/* page is resident in PTE_FRAME (TLBLO_VALID) */
+#define PTE_MODIFIED   0x00000010	/* contents must be saved to swap if evicted */
+#define PTE_SWAPPED    0x00000008	/* contents are in swap */
+#define PTE_REFERENCED 0x00000004	/* used since the clock hand last passed */
+#define PTE_WRITEABLE  0x00000002	/* page may be written */
+#define PTE_COW        0x00000001	/* frame is shared; copy it on first write */
+
+#define PTE_TLBBITS    (PTE_FRAME | PTE_DIRTY | PTE_VALID)
+#define PTE_SLOT(pte)  ((pte) >> 12)
+
+/*
+ * Two-level page table: the top 10 bits of a virtual address index the
+ * directory, the next 10 bits index a second-level table of PT_ENTRIES
+ * entries, and the low 12 bits are the page offset.
+ */
+#define PT_ENTRIES          1024
+#define PT_L1_INDEX(va)     ((va) >> 22)
+#define PT_L2_INDEX(va)     (((va) >> 12) & (PT_ENTRIES - 1))
+#define PT_VADDR(l1, l2)    (((vaddr_t)(l1) << 22) | ((vaddr_t)(l2) << 12))
+
+/*
+ * The part of an ELF segment whose contents come from the executable.
+ * Pages overlapping [vaddr, vaddr+fileSize) are read from the file at
+ * offset + (address - vaddr) when first touched; everything else in
+ * the address space is zero-filled on demand.
+ */
+struct segmentBacking {
+  vaddr_t vaddr;		/* where the file data starts (need not be aligned) */
+  size_t fileSize;		/* bytes of file data */
+  off_t offset;			/* file offset of the first byte */
+};
+
+#define AS_NBACKING 2
+#endif
+
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -48,6 +104,20 @@ struct vnode;
  */
 
 struct addrspace {
+#if OPT_A3
+  vaddr_t as_vbase1;
+  size_t as_npages1;
+  vaddr_t as_vbase2;
+  size_t as_npages2;
+  pte_t **as_pagetable;		/* directory of PT_ENTRIES second-level tables */
+  struct vnode *as_vnode;	/* executable, referenced while pages may still come from it */
+  struct segmentBacking as_backing[AS_NBACKING];
+  unsigned as_nbacking;
+  uint32_t as_asid[MAXCPUS];	/* TLB address space ID on each cpu, */
+  uint32_t as_asidgen[MAXCPUS];	/* valid while this is the cpu's ASID generation */
+  struct addrspace *as_next;	/* on the list of all address spaces */
+  bool load_elf_done;
+#else
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
   size_t as_npages1;
@@ -56,6 +126,7 @@ struct addrspace {
   size_t as_npages2;
   paddr_t as_stackpbase;
   bool load_elf_done;
+#endif
 };
 
 /*
@@ -109,6 +180,17 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if OPT_A3
+/*
+ *    as_define_backing - record that the segment at VADDR (MEMSIZE bytes
+ *                in memory) gets its first FILESIZE bytes from V at
+ *                OFFSET. Nothing is read until the pages are touched.
+ */
+int               as_define_backing(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t memsize, size_t filesize);
+#endif
+
 
 /*
  * Functions in loadelf.c
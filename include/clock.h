@@ -38,8 +38,8 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU once every LT_GRANULARITY usec
+ * to run timed sleeps.
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -83,5 +83,11 @@ void clocksleep(int seconds);
  */
 void clocknap(int ticks);
 
+/*
+ * clocknanosleep() suspends execution for at least the given time,
+ * rounded up to whole timer ticks. Used by nanosleep().
+ */
+void clocknanosleep(time_t seconds, uint32_t nanoseconds);
+
 
 #endif /* _CLOCK_H_ */
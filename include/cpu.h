@@ -32,6 +32,7 @@
 
 
 #include <spinlock.h>
+#include <mcslock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
@@ -46,6 +47,9 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/* Number of multi-level feedback queue levels (run queues per cpu). */
+#define MLFQ_LEVELS 3
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -60,14 +64,21 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_stolen;		/* Threads pulled from other cpus */
+	unsigned c_hotskips;		/* Cache-hot threads left behind */
+	struct mcsnode c_mcsnodes[MCS_NODES]; /* For mcslock queues */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * There is one run queue per MLFQ level; c_runqueue[0] is the
+	 * highest priority. See schedule() in thread.c.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
-	struct spinlock c_runqueue_lock;
+	struct threadlist c_runqueue[MLFQ_LEVELS]; /* Run queues */
+	volatile unsigned c_nrunnable;	/* Total queued; read unlocked */
+	struct mcslock c_runqueue_lock;
 
 	/*
 	 * Accessed by other cpus.
@@ -82,10 +93,14 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdown_gen counts batches of shootdowns this cpu has
+	 * finished, so a sender can wait for its request to be done.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	volatile unsigned c_shootdown_gen;
 	struct spinlock c_ipi_lock;
 };
 
@@ -152,6 +167,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_sync flushes the mapping on every CPU, this one
+ * included, and waits until the others have acted on it. It must not
+ * be called with interrupts disabled.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +184,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_sync(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
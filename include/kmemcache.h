@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A cache hands out fixed-size objects carved from whole pages
+ * ("slabs"). An object is constructed by CTOR the first time it is
+ * handed out, and stays constructed while it sits free in the cache,
+ * so the next kmem_cache_alloc can skip that work. DTOR is only run
+ * when the cache gives a slab's memory back, which it does once more
+ * than one slab is entirely free.
+ *
+ *    kmem_cache_create  - make a cache of SIZE-byte objects. NAME is
+ *                         for debugging and is not copied. CTOR
+ *                         returns 0 or an error code; either hook
+ *                         may be NULL.
+ *
+ *    kmem_cache_destroy - destroy a cache. All objects must have
+ *                         been freed.
+ *
+ *    kmem_cache_alloc   - get an object, or NULL if out of memory or
+ *                         the constructor failed.
+ *
+ *    kmem_cache_free    - give an object back. It must be in the
+ *                         same state the constructor left it in.
+ *
+ *    kmem_cache_getstats - fill in up to MAX entries of STATS, one
+ *                         per cache, and return how many there are.
+ *                         Slab pages come straight from alloc_kpages,
+ *                         so the kmalloc statistics don't see them;
+ *                         this is how kheap_printstats reports them.
+ *
+ * Objects must be small enough that several fit in a page. Creating
+ * and destroying caches may use kmalloc; alloc and free may be used
+ * anywhere kmalloc can, as long as the hooks can be too.
+ */
+
+struct kmem_cache;	/* Opaque */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+struct kmem_cache_stats {
+	const char *kcs_name;		/* same pointer for the same cache */
+	size_t kcs_size;		/* object size */
+	unsigned kcs_allocs;		/* objects handed out, ever */
+	unsigned kcs_frees;		/* objects given back, ever */
+	unsigned kcs_slabs;		/* pages currently held */
+};
+
+unsigned kmem_cache_getstats(struct kmem_cache_stats *stats, unsigned max);
+
+#endif /* _KMEMCACHE_H_ */
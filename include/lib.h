@@ -122,10 +122,16 @@ uint32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * kmalloc_caller is for wrappers like kstrdup: the heap statistics
+ * charge the allocation to CALLER instead of to the wrapper.
  */
 void *kmalloc(size_t size);
+void *kmalloc_caller(size_t size, vaddr_t caller);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_snapshot(void);
+void kheap_printdiff(void);
 
 /*
  * C string functions. 
@@ -55,6 +55,14 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Stop and restart the current cpu's periodic hardclock tick, for
+ * tickless idle. While stopped, only other interrupts (IPIs and
+ * devices) wake the cpu. Call with interrupts off.
+ */
+void mainbus_tick_stop(void);
+void mainbus_tick_start(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
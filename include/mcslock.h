@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MCSLOCK_H_
+#define _MCSLOCK_H_
+
+/*
+ * Queue-based (MCS) spinlocks.
+ *
+ * These work like spinlocks - held by CPUs, with interrupts off - but
+ * waiters queue up in order, and each one spins on a node of its own
+ * instead of all of them hammering the lock word. So acquisition is
+ * FIFO, and a release only disturbs the next waiter. They cost a
+ * little more than a spinlock when uncontended; use them for locks
+ * that many cpus fight over.
+ *
+ * Each cpu has MCS_NODES queue nodes, so it can hold (or wait for)
+ * that many mcslocks at once.
+ *
+ * The functions are the same as for spinlocks; see spinlock.h.
+ */
+
+struct cpu;	/* from <cpu.h> */
+
+#define MCS_NODES 8
+
+struct mcsnode {
+	struct mcsnode *volatile mn_next;	/* Next waiter */
+	volatile bool mn_wait;			/* Spin while true */
+	bool mn_inuse;				/* Allocated by this cpu */
+};
+
+struct mcslock {
+	struct mcsnode *volatile ml_tail;	/* Last in queue, or NULL */
+	struct mcsnode *ml_node;		/* Holder's node */
+	struct cpu *ml_holder;			/* CPU holding this lock */
+};
+
+#define MCSLOCK_INITIALIZER	{ NULL, NULL, NULL }
+
+void mcslock_init(struct mcslock *ml);
+void mcslock_cleanup(struct mcslock *ml);
+
+void mcslock_acquire(struct mcslock *ml);
+void mcslock_release(struct mcslock *ml);
+
+bool mcslock_do_i_hold(struct mcslock *ml);
+
+/* Set up a cpu's queue nodes. */
+void mcsnodes_init(struct mcsnode *nodes);
+
+
+#endif /* _MCSLOCK_H_ */
@@ -125,6 +125,10 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
+/* Get and set the scheduling priority of a process's threads. */
+int proc_getpriority(struct proc *proc);
+void proc_setpriority(struct proc *proc, int priority);
+
 #if OPT_A2
 pid_t create_pid(void);
 int proc_add_child(struct proc *currentProc, struct proc *childProc);
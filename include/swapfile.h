@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAPFILE_H_
+#define _SWAPFILE_H_
+
+/*
+ * Swap space.
+ *
+ * Pages evicted by the VM system are written to page-sized slots on
+ * the swap device, the raw lhd0 disk. Free slots are tracked in a
+ * bitmap. If there is no swap device swapping is simply disabled and
+ * swap_alloc always fails.
+ *
+ *    swap_bootstrap - open the swap device. Called from vm_bootstrap.
+ *
+ *    swap_alloc - reserve a slot. Returns ENOSPC if there are none.
+ *
+ *    swap_free  - release a slot.
+ *
+ *    swap_write - copy the page at physical address PADDR to SLOT.
+ *
+ *    swap_read  - copy SLOT into the page at physical address PADDR.
+ *
+ * swap_write and swap_read do disk I/O and so may sleep.
+ */
+
+#define SWAP_DEVICE "lhd0raw:"
+
+void swap_bootstrap(void);
+int  swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int  swap_write(unsigned slot, paddr_t paddr);
+int  swap_read(unsigned slot, paddr_t paddr);
+
+#endif /* _SWAPFILE_H_ */
@@ -37,6 +37,17 @@
 
 #include <spinlock.h>
 #include <thread.h>
+
+/*
+ * Semaphores, locks and CVs come from object caches, and keep their
+ * wait channels while they sit free in the cache. The copy of the
+ * name is kept in the structure (truncated if need be) rather than
+ * allocated separately. Call synch_bootstrap before creating any.
+ */
+#define SYNCH_NAMELEN 32
+
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
@@ -44,10 +55,11 @@
  * internally.
  */
 struct semaphore {
-        char *sem_name;
+        char sem_name[SYNCH_NAMELEN];
 	struct wchan *sem_wchan;
 	struct spinlock sem_lock;
         volatile int sem_count;
+	bool sem_handoff;		/* V gives straight to a sleeper */
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
@@ -58,9 +70,17 @@ void sem_destroy(struct semaphore *);
  *     P (proberen): decrement count. If the count is 0, block until
  *                   the count is 1 again before decrementing.
  *     V (verhogen): increment count.
+ *
+ *     sem_sethandoff - Choose strict FIFO handoff. Normally V just
+ *                   wakes a sleeper, which then races anyone else in
+ *                   P for the count. In handoff mode V gives its unit
+ *                   directly to the longest sleeper instead, and only
+ *                   counts it if nobody is asleep. No thread may be
+ *                   in P when the mode is changed.
  */
 void P(struct semaphore *);
 void V(struct semaphore *);
+void sem_sethandoff(struct semaphore *, bool handoff);
 
 
 /*
@@ -73,13 +93,17 @@ void V(struct semaphore *);
  * (should be) made internally.
  */
 struct lock {
-        char *lk_name;
+        char lk_name[SYNCH_NAMELEN];
         // add what you need here
         // (don't forget to mark things volatile as needed)
-        struct spinlock spin;
-        struct thread *owner;
+        volatile spinlock_data_t lk_word;  /* 1 while held */
+        struct thread *volatile owner;
+        struct spinlock spin;              /* protects lk_waiters */
+        volatile unsigned lk_waiters;      /* threads on lock_wchan */
         struct wchan *lock_wchan;
-        volatile bool held;
+        struct lock *lk_heldnext;          /* next in owner's t_heldlocks */
+        struct thread *lk_piwaiters;       /* sleepers, for inheritance */
+        bool lk_handoff;                   /* release passes to a sleeper */
 };
 
 struct lock *lock_create(const char *name);
@@ -95,10 +119,33 @@ void lock_acquire(struct lock *);
  *                   false otherwise.
  *
  * These operations must be atomic. You get to write them.
+ *
+ * The lock is adaptive: a thread that finds it held spins for a while
+ * if the holder is running on another cpu, since it will probably
+ * release it soon, and only sleeps if it isn't or doesn't. Taking and
+ * releasing an uncontended lock is a single atomic operation.
+ *
+ * Locks do priority inheritance: a thread that goes to sleep on a
+ * lock lends its priority to the holder, and on through whatever lock
+ * the holder is asleep on in turn, until the holder lets go.
+ *
+ *    lock_setpriority - Set a thread's own priority, keeping whatever
+ *                   it has been lent.
+ *
+ *    lock_sethandoff - Choose strict FIFO handoff. Normally release
+ *                   wakes one sleeper, which has to race newcomers
+ *                   for the lock and may lose and sleep again. In
+ *                   handoff mode release makes the longest sleeper
+ *                   the owner before waking it, so sleepers get the
+ *                   lock in the order they went to sleep; newcomers
+ *                   only get it when nobody is asleep. The lock must
+ *                   be free, with no waiters, when the mode changes.
  */
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
+void lock_setpriority(struct thread *, int priority);
+void lock_sethandoff(struct lock *, bool handoff);
 
 
 /*
@@ -116,7 +163,7 @@ void lock_destroy(struct lock *);
  */
 
 struct cv {
-        char *cv_name;
+        char cv_name[SYNCH_NAMELEN];
         // add what you need here
         struct wchan *cv_wchan;
         // (don't forget to mark things volatile as needed)
@@ -137,10 +184,66 @@ void cv_destroy(struct cv *);
  * on all operations with any particular CV.
  *
  * These operations must be atomic. You get to write them.
+ *
+ * Signal and broadcast don't wake anyone directly: they move the
+ * sleepers onto the lock's queue, and lock_release wakes them one at
+ * a time as the lock comes free ("wait morphing"), so a broadcast
+ * doesn't start a stampede for the lock.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads can hold the lock for reading at once, or one
+ * thread can hold it for writing. Writers get preference: once a
+ * writer is waiting, new readers wait behind it, so a steady stream
+ * of readers can't starve writers. (This means a thread that already
+ * holds the lock for reading must not try to take it for reading
+ * again; if a writer has arrived in between, it will deadlock.)
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+
+struct rwlock {
+        char rw_name[SYNCH_NAMELEN];
+        struct spinlock rw_lock;        /* protects everything below */
+        struct wchan *rw_readwchan;     /* readers waiting */
+        struct wchan *rw_writewchan;    /* writers waiting */
+        unsigned rw_readers;            /* threads holding it to read */
+        unsigned rw_writerswaiting;     /* threads on rw_writewchan */
+        struct thread *rw_writer;       /* thread holding it to write */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read   - Get the lock for reading. Blocks while a
+ *                            writer holds the lock or is waiting for it.
+ *    rwlock_release_read   - Give up a read hold.
+ *    rwlock_acquire_write  - Get the lock for writing. Blocks until
+ *                            there are no readers and no writer.
+ *    rwlock_release_write  - Give up the write hold.
+ *    rwlock_downgrade      - Turn a write hold into a read hold
+ *                            without letting any other writer in
+ *                            between. Waiting readers are let in too,
+ *                            unless a writer is also waiting.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                            the lock for writing. (Read holds aren't
+ *                            tracked per thread.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -56,6 +56,7 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t req, userptr_t rem);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
@@ -67,6 +68,8 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(const char *program, char **args);
+int sys_getpriority(int which, pid_t who, int *retval);
+int sys_setpriority(int which, pid_t who, int prio);
 
 
 #endif /* _SYSCALL_H_ */
@@ -60,6 +60,11 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int pctest(int, char **);
+int rwbench(int, char **);
+int slbench(int, char **);
+int hobench(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -81,9 +82,29 @@ struct thread {
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
-	struct cpu *t_cpu;		/* CPU thread runs on */
+	struct cpu *t_cpu;		/* CPU thread runs on, or last ran on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduler fields. Changed only with t_cpu's run queue lock
+	 * held; t_priority is set through thread_setpriority, by
+	 * lock_setpriority and priority inheritance.
+	 */
+	int t_priority;			/* Nice value; lower runs first */
+	unsigned t_mlfq_level;		/* Run queue level; 0 is highest */
+	unsigned t_mlfq_ticks;		/* Hardclocks used at this level */
+	unsigned t_lastrun;		/* t_cpu's c_hardclocks when last run */
+
+	/*
+	 * Priority inheritance fields; see synch.c. t_heldlocks is
+	 * only touched by the thread itself, the rest only with the
+	 * inheritance lock held.
+	 */
+	int t_basepriority;		/* t_priority before inheritance */
+	struct lock *t_waitlock;	/* Lock we're asleep on, or NULL */
+	struct thread *t_pinext;	/* Next waiter on t_waitlock */
+	struct lock *t_heldlocks;	/* Locks we hold */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -157,16 +178,29 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge a hardclock to the current thread, and yield if its quantum
+ * is used up or a higher-priority thread is waiting. Called from the
+ * timer interrupt.
+ */
+void thread_tick(void);
+
+/*
+ * Set a thread's effective priority (t_priority), re-sorting it on
+ * its run queue if it is waiting for a cpu. Used by priority
+ * inheritance; see lock_setpriority in synch.h for the base priority.
+ */
+void thread_setpriority(struct thread *t, int priority);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Print per-cpu scheduler statistics.
  */
-void thread_consider_migration(void);
+void thread_printcpustats(void);
 
 
 #endif /* _THREAD_H_ */
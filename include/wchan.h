@@ -36,6 +36,7 @@
 
 
 struct wchan; /* Opaque */
+struct thread; /* from <thread.h> */
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -75,11 +76,27 @@ void wchan_sleep(struct wchan *wc);
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
  *
- * The current implementation is FIFO but this is not promised by the
- * interface.
+ * wchan_wakeone returns the thread it woke, or NULL if there was
+ * nobody; it takes the longest sleeper. Callers that hand something
+ * to that thread must do so under a lock the thread takes after
+ * waking, since it may run at once.
  */
-void wchan_wakeone(struct wchan *wc);
+struct thread *wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up one particular thread, which must be sleeping on the
+ * channel. For callers that keep their own record of who is asleep
+ * and why, such as timeouts. The queue should not already be locked.
+ */
+void wchan_wakethread(struct wchan *wc, struct thread *target);
+
+/*
+ * Move the longest sleeper on FROM to the back of TO without waking
+ * it, and return it, or NULL if FROM was empty. It will wake when TO
+ * is woken. Neither queue should already be locked.
+ */
+struct thread *wchan_moveone(struct wchan *from, struct wchan *to);
+
 
 #endif /* _WCHAN_H_ */
@@ -49,6 +49,7 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <kmemcache.h>
 #include <kern/fcntl.h>
 
 #include <limits.h>
@@ -72,9 +73,17 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;
 #endif  // UW
 
+/*
+ * Object caches for proc structures and the records parents keep
+ * about their children. Neither needs a constructor; the point is to
+ * pack them into slabs and recycle them without going through kmalloc.
+ */
+static struct kmem_cache *proc_cache;
+
 #if OPT_A2
 static struct lock *pid_lock;
 static volatile unsigned int pidCount;
+static struct kmem_cache *childdata_cache;
 
 #else
 #endif
@@ -90,13 +99,13 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
@@ -208,6 +217,7 @@ proc_destroy(struct proc *proc)
 		struct childProcessData *childData = (struct childProcessData *) array_get(proc->children, i);
 		childData->childProcess->parentProc = NULL;
 		array_remove(proc->children, i);
+		kmem_cache_free(childdata_cache, childData);
 	}
 	// array_destroy(proc->children);
 	lock_release(proc->processLock);
@@ -226,6 +236,19 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+  proc_cache = kmem_cache_create("proc", sizeof(struct proc), NULL, NULL);
+  if (proc_cache == NULL) {
+    panic("could not create proc cache\n");
+  }
+#if OPT_A2
+  childdata_cache = kmem_cache_create("childProcessData",
+				      sizeof(struct childProcessData),
+				      NULL, NULL);
+  if (childdata_cache == NULL) {
+    panic("could not create childProcessData cache\n");
+  }
+#endif
+
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -406,6 +429,43 @@ curproc_setas(struct addrspace *newas)
 	return oldas;
 }
 
+/*
+ * Set the scheduling priority (nice value) of every thread in a
+ * process. Threads already on a run queue keep their place until
+ * they're next queued. Threads the process forks later inherit it.
+ */
+void
+proc_setpriority(struct proc *proc, int priority)
+{
+	unsigned i, num;
+
+	spinlock_acquire(&proc->p_lock);
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		lock_setpriority(threadarray_get(&proc->p_threads, i),
+				 priority);
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+/*
+ * Get a process's priority: that of its first thread, or the default
+ * of 0 if it has none left.
+ */
+int
+proc_getpriority(struct proc *proc)
+{
+	int priority;
+
+	priority = 0;
+	spinlock_acquire(&proc->p_lock);
+	if (threadarray_num(&proc->p_threads) > 0) {
+		priority = threadarray_get(&proc->p_threads, 0)->t_basepriority;
+	}
+	spinlock_release(&proc->p_lock);
+	return priority;
+}
+
 
 
 #if OPT_A2
@@ -426,7 +486,7 @@ create_pid(void) {
 int
 proc_add_child(struct proc *currentProc, struct proc *childProc) {
 	lock_acquire(currentProc->processLock);
-	struct childProcessData *child = kmalloc(sizeof(struct childProcessData));
+	struct childProcessData *child = kmem_cache_alloc(childdata_cache);
 	child->pid = childProc->pid;
 	child->exitCode = -1;
 	child->exitStatus = !childProc->isAlive;
@@ -50,6 +50,10 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#endif
 
 
 /*
@@ -107,6 +111,7 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -153,6 +158,11 @@ shutdown(void)
 
 	thread_shutdown();
 
+#if OPT_A3
+	/* Only this thread is left, as vmstats_print requires. */
+	vmstats_print();
+#endif
+
 	splhigh();
 }
 
@@ -415,6 +415,43 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapsnapshot(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_snapshot();
+	kprintf("Kernel heap statistics snapshot taken\n");
+
+	return 0;
+}
+
+static
+int
+cmd_kheapdiff(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printdiff();
+
+	return 0;
+}
+
+static
+int
+cmd_cpustats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printcpustats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -485,6 +522,11 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Rwlock test                   ",
+	"[sy5] Producer/consumer CV test     ",
+	"[rwb] Rwlock read benchmark         ",
+	"[slb] Spinlock contention benchmark ",
+	"[hob] Lock/semaphore handoff bench  ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -525,6 +567,9 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[khs] Snapshot kernel heap stats    ",
+	"[khd] Heap stats since snapshot     ",
+	"[cs] CPU scheduler stats            ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -582,6 +627,9 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "khs",        cmd_kheapsnapshot },
+	{ "khd",        cmd_kheapdiff },
+	{ "cs",         cmd_cpustats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -599,6 +647,11 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "sy5",	pctest },
+	{ "rwb",	rwbench },
+	{ "slb",	slbench },
+	{ "hob",	hobench },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -84,6 +84,24 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if OPT_A3
+	(void)is_executable;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	/*
+	 * Nothing is read here; vm_fault pulls each page in from V the
+	 * first time it is touched. Since uiomove no longer sees the
+	 * destination, as_define_backing checks it is in user space.
+	 */
+	return as_define_backing(as, v, offset, vaddr, memsize, filesize);
+#else
 	struct iovec iov;
 	struct uio u;
 	int result;
@@ -146,6 +164,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 
 	return result;
+#endif /* OPT_A3 */
 }
 
 /*
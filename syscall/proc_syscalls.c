@@ -2,6 +2,8 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <mips/trapframe.h>
 #include <syscall.h>
@@ -485,3 +487,95 @@ sys_execv(const char *program, char **args) {
 
   #endif
 }
+
+
+/*
+ * getpriority() and setpriority(). Only PRIO_PROCESS is supported,
+ * since there are no process groups or users. WHO may be 0 or our own
+ * pid for ourselves, or the pid of one of our live children. Priorities
+ * are nice values; setpriority clamps them to [PRIO_MIN, PRIO_MAX].
+ *
+ * On success the target process is returned with the parent's
+ * processLock held (if it's a child) so it can't exit underneath us;
+ * call priority_done() when finished with it.
+ */
+static
+int
+priority_lookup(int which, pid_t who, struct proc **ret)
+{
+  if (which != PRIO_PROCESS) {
+    return EINVAL;
+  }
+  if (who == 0) {
+    *ret = curproc;
+    return 0;
+  }
+  #if OPT_A2
+  if (who == curproc->pid) {
+    *ret = curproc;
+    return 0;
+  }
+  lock_acquire(curproc->processLock);
+  for (unsigned int i = 0 ; i < array_num(curproc->children) ; i ++) {
+    struct childProcessData *childData = array_get(curproc->children, i);
+    if (childData->pid == who && !childData->exitStatus) {
+      *ret = childData->childProcess;
+      return 0;
+    }
+  }
+  lock_release(curproc->processLock);
+  #endif
+  return ESRCH;
+}
+
+static
+void
+priority_done(struct proc *p)
+{
+  #if OPT_A2
+  if (p != curproc) {
+    lock_release(curproc->processLock);
+  }
+  #else
+  (void)p;
+  #endif
+}
+
+int
+sys_getpriority(int which, pid_t who, int *retval)
+{
+  struct proc *p;
+  int result;
+
+  result = priority_lookup(which, who, &p);
+  if (result) {
+    return result;
+  }
+  *retval = proc_getpriority(p);
+  priority_done(p);
+  return 0;
+}
+
+int
+sys_setpriority(int which, pid_t who, int prio)
+{
+  struct proc *p;
+  int result;
+
+  if (prio < PRIO_MIN) {
+    prio = PRIO_MIN;
+  }
+  if (prio > PRIO_MAX) {
+    prio = PRIO_MAX;
+  }
+
+  result = priority_lookup(which, who, &p);
+  if (result) {
+    return result;
+  }
+  proc_setpriority(p, prio);
+  priority_done(p);
+
+  DEBUG(DB_SYSCALL, "Syscall: setpriority(%d, %d)\n", (int)who, prio);
+  return 0;
+}
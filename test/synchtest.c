@@ -34,6 +34,8 @@
 #include <types.h>
 #include <lib.h>
 #include <clock.h>
+#include <spinlock.h>
+#include <mcslock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -347,3 +349,701 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test.
+ *
+ * Every thread mostly reads and now and then writes. Readers check
+ * that no writer is in, and that the values the last writer left are
+ * consistent; writers check that they're alone. Some writes are
+ * downgraded to reads partway. Readers yield inside the lock so that
+ * they overlap even on one cpu.
+ */
+
+#define NRWLOOPS      120
+
+static struct rwlock *testrw;
+static struct spinlock rwtest_spin = SPINLOCK_INITIALIZER;
+static volatile unsigned rwtest_readers;	/* in the lock to read */
+static volatile unsigned rwtest_writers;	/* in the lock to write */
+static volatile unsigned rwtest_maxreaders;
+static volatile unsigned rwtest_failures;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	spinlock_acquire(&rwtest_spin);
+	rwtest_failures++;
+	spinlock_release(&rwtest_spin);
+}
+
+static
+void
+rwcheckvals(unsigned long num)
+{
+	if (testval2 != testval1*testval1) {
+		rwfail(num, "Mismatch on testval2/testval1");
+	}
+	if (testval3 != testval1%3) {
+		rwfail(num, "Mismatch on testval3/testval1");
+	}
+}
+
+static
+void
+rwtest_read(unsigned long num)
+{
+	spinlock_acquire(&rwtest_spin);
+	rwtest_readers++;
+	if (rwtest_readers > rwtest_maxreaders) {
+		rwtest_maxreaders = rwtest_readers;
+	}
+	if (rwtest_writers != 0) {
+		spinlock_release(&rwtest_spin);
+		rwfail(num, "Reader got in with a writer");
+		spinlock_acquire(&rwtest_spin);
+	}
+	spinlock_release(&rwtest_spin);
+
+	rwcheckvals(num);
+	thread_yield();
+	rwcheckvals(num);
+
+	spinlock_acquire(&rwtest_spin);
+	rwtest_readers--;
+	spinlock_release(&rwtest_spin);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (i % 8 != num % 8) {
+			rwlock_acquire_read(testrw);
+			rwtest_read(num);
+			rwlock_release_read(testrw);
+			continue;
+		}
+
+		rwlock_acquire_write(testrw);
+		if (!rwlock_do_i_hold_write(testrw)) {
+			rwfail(num, "Writer doesn't hold the lock");
+		}
+		spinlock_acquire(&rwtest_spin);
+		if (rwtest_readers != 0 || rwtest_writers != 0) {
+			spinlock_release(&rwtest_spin);
+			rwfail(num, "Writer got in with someone else");
+			spinlock_acquire(&rwtest_spin);
+		}
+		rwtest_writers++;
+		spinlock_release(&rwtest_spin);
+
+		testval1 = num;
+		thread_yield();
+		testval2 = num*num;
+		testval3 = num%3;
+
+		spinlock_acquire(&rwtest_spin);
+		rwtest_writers--;
+		spinlock_release(&rwtest_spin);
+
+		if (i % 16 == num % 16) {
+			rwlock_downgrade(testrw);
+			if (testval1 != num) {
+				rwfail(num, "Value changed across downgrade");
+			}
+			rwtest_read(num);
+			rwlock_release_read(testrw);
+		}
+		else {
+			rwlock_release_write(testrw);
+		}
+	}
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = testval3 = 0;
+	rwtest_readers = rwtest_writers = 0;
+	rwtest_maxreaders = rwtest_failures = 0;
+
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", NULL, rwtestthread,
+				     NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+	kprintf("Up to %u readers at once\n", rwtest_maxreaders);
+	if (rwtest_failures > 0) {
+		kprintf("Test failed (%u errors)\n", rwtest_failures);
+	}
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
+
+/*
+ * Producer/consumer test: PC_PRODUCERS threads push numbered items
+ * through a PC_SLOTS-item buffer to PC_CONSUMERS threads, with one
+ * lock and two CVs. Consumers check that each producer's items come
+ * out once each and in order. It is meant for a configuration with
+ * several cpus (set in sys161.conf): the buffer is small so waiters
+ * are signalled constantly, often from another cpu just as they are
+ * going to sleep, which is when a CV wakeup moves a thread that is
+ * still switching out (see wchan_moveone). It runs with the lock in
+ * normal and then in handoff mode.
+ */
+
+#define PC_SLOTS      4
+#define PC_PRODUCERS  4
+#define PC_CONSUMERS  4
+#define PC_ITEMS      300
+#define PC_TOTAL      (PC_PRODUCERS * PC_ITEMS)
+
+static struct lock *pc_lock;
+static struct cv *pc_notfull;
+static struct cv *pc_notempty;
+static unsigned pc_buf[PC_SLOTS];
+static unsigned pc_head, pc_count;	/* protected by pc_lock */
+static unsigned pc_consumed;
+static unsigned pc_next[PC_PRODUCERS];	/* next item expected from each */
+static unsigned pc_failures;
+
+static
+void
+pcproducer(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+
+	for (i=0; i<PC_ITEMS; i++) {
+		lock_acquire(pc_lock);
+		while (pc_count == PC_SLOTS) {
+			cv_wait(pc_notfull, pc_lock);
+		}
+		pc_buf[(pc_head + pc_count) % PC_SLOTS] = num * PC_ITEMS + i;
+		pc_count++;
+		cv_signal(pc_notempty, pc_lock);
+		lock_release(pc_lock);
+	}
+	V(donesem);
+}
+
+static
+void
+pcconsumer(void *junk, unsigned long num)
+{
+	unsigned item, producer;
+
+	(void)junk;
+
+	lock_acquire(pc_lock);
+	while (1) {
+		while (pc_count == 0 && pc_consumed < PC_TOTAL) {
+			cv_wait(pc_notempty, pc_lock);
+		}
+		if (pc_consumed == PC_TOTAL) {
+			break;
+		}
+
+		item = pc_buf[pc_head];
+		pc_head = (pc_head + 1) % PC_SLOTS;
+		pc_count--;
+		pc_consumed++;
+
+		producer = item / PC_ITEMS;
+		if (producer >= PC_PRODUCERS ||
+		    pc_next[producer] != item % PC_ITEMS) {
+			kprintf("thread %lu: got item %u out of order\n",
+				num, item);
+			pc_failures++;
+		}
+		else {
+			pc_next[producer]++;
+		}
+
+		/* Wake every producer, to give the morphing some work. */
+		cv_broadcast(pc_notfull, pc_lock);
+		if (pc_consumed == PC_TOTAL) {
+			/* Let the other consumers see we're done. */
+			cv_broadcast(pc_notempty, pc_lock);
+		}
+	}
+	lock_release(pc_lock);
+	V(donesem);
+}
+
+static
+void
+pcrun(bool handoff)
+{
+	unsigned i;
+	int result;
+
+	lock_sethandoff(pc_lock, handoff);
+	pc_head = pc_count = pc_consumed = 0;
+	for (i=0; i<PC_PRODUCERS; i++) {
+		pc_next[i] = 0;
+	}
+
+	for (i=0; i<PC_PRODUCERS; i++) {
+		result = thread_fork("pctest", NULL, pcproducer, NULL, i);
+		if (result) {
+			panic("pctest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<PC_CONSUMERS; i++) {
+		result = thread_fork("pctest", NULL, pcconsumer, NULL, i);
+		if (result) {
+			panic("pctest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<PC_PRODUCERS + PC_CONSUMERS; i++) {
+		P(donesem);
+	}
+
+	for (i=0; i<PC_PRODUCERS; i++) {
+		if (pc_next[i] != PC_ITEMS) {
+			kprintf("producer %u: %u of %u items arrived\n",
+				i, pc_next[i], PC_ITEMS);
+			pc_failures++;
+		}
+	}
+}
+
+int
+pctest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	pc_lock = lock_create("pc_lock");
+	pc_notfull = cv_create("pc_notfull");
+	pc_notempty = cv_create("pc_notempty");
+	if (pc_lock == NULL || pc_notfull == NULL || pc_notempty == NULL) {
+		panic("pctest: Out of memory\n");
+	}
+	pc_failures = 0;
+
+	kprintf("Starting producer/consumer test...\n");
+	pcrun(false);
+	pcrun(true);
+
+	cv_destroy(pc_notempty);
+	cv_destroy(pc_notfull);
+	lock_destroy(pc_lock);
+
+	if (pc_failures > 0) {
+		kprintf("Test failed (%u errors)\n", pc_failures);
+	}
+	kprintf("Producer/consumer test done.\n");
+
+	return 0;
+}
+
+/*
+ * Reader scalability benchmark: 1 to RWB_MAXTHREADS workers doing nothing
+ * but short read-side critical sections, first under a rwlock taken
+ * for reading and then under a plain lock. With more than one cpu the
+ * rwlock times should stay flat as threads are added; the lock times
+ * grow with the thread count.
+ */
+
+#define RWB_LOOPS     2000
+#define RWB_WORK      100
+#define RWB_MAXTHREADS 8
+
+static struct lock *rwb_lock;
+static struct rwlock *rwb_rwlock;
+static struct semaphore *rwb_done;
+
+static
+void
+rwbthread(void *junk, unsigned long userw)
+{
+	int i;
+	volatile int j;
+
+	(void)junk;
+
+	for (i=0; i<RWB_LOOPS; i++) {
+		if (userw) {
+			rwlock_acquire_read(rwb_rwlock);
+		}
+		else {
+			lock_acquire(rwb_lock);
+		}
+		for (j=0; j<RWB_WORK; j++);
+		if (userw) {
+			rwlock_release_read(rwb_rwlock);
+		}
+		else {
+			lock_release(rwb_lock);
+		}
+	}
+	V(rwb_done);
+}
+
+/* Run NTHREADS workers and return how long they took, in usec. */
+static
+uint32_t
+rwbrun(unsigned nthreads, bool userw)
+{
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	unsigned i;
+	int result;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("rwbench", NULL, rwbthread, NULL, userw);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(rwb_done);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+	return rsecs * 1000000 + rnsecs / 1000;
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	unsigned nthreads;
+
+	(void)nargs;
+	(void)args;
+
+	rwb_lock = lock_create("rwb_lock");
+	rwb_rwlock = rwlock_create("rwb_rwlock");
+	rwb_done = sem_create("rwb_done", 0);
+	if (rwb_lock == NULL || rwb_rwlock == NULL || rwb_done == NULL) {
+		panic("rwbench: Out of memory\n");
+	}
+
+	kprintf("%u read sections per thread\n", RWB_LOOPS);
+	kprintf("threads  rwlock (usec)  lock (usec)\n");
+	for (nthreads = 1; nthreads <= RWB_MAXTHREADS; nthreads *= 2) {
+		kprintf("%7u  %13u", nthreads, rwbrun(nthreads, true));
+		kprintf("  %11u\n", rwbrun(nthreads, false));
+	}
+
+	sem_destroy(rwb_done);
+	rwlock_destroy(rwb_rwlock);
+	lock_destroy(rwb_lock);
+
+	return 0;
+}
+
+/*
+ * Spinlock contention benchmark: SLB_THREADS threads take the same
+ * lock over and over with a short critical section, first a plain
+ * spinlock and then an mcslock. Each acquisition is timed, and we
+ * report the average and worst-case wait. With several cpus the
+ * spinlock's worst case is much worse than its average, since nothing
+ * stops one cpu losing the race repeatedly; the mcslock serves
+ * waiters in order.
+ */
+
+#define SLB_THREADS   8
+#define SLB_LOOPS     500
+#define SLB_WORK      50
+
+static struct spinlock slb_spinlock = SPINLOCK_INITIALIZER;
+static struct mcslock slb_mcslock = MCSLOCK_INITIALIZER;
+static struct semaphore *slb_done;
+static struct spinlock slb_statlock = SPINLOCK_INITIALIZER;
+static uint64_t slb_totalns;
+static uint32_t slb_maxns;
+
+static
+void
+slbthread(void *junk, unsigned long usemcs)
+{
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs, ns, maxns;
+	uint64_t totalns;
+	int i;
+	volatile int j;
+
+	(void)junk;
+
+	totalns = 0;
+	maxns = 0;
+	for (i=0; i<SLB_LOOPS; i++) {
+		gettime(&secs1, &nsecs1);
+		if (usemcs) {
+			mcslock_acquire(&slb_mcslock);
+		}
+		else {
+			spinlock_acquire(&slb_spinlock);
+		}
+		gettime(&secs2, &nsecs2);
+
+		for (j=0; j<SLB_WORK; j++);
+
+		if (usemcs) {
+			mcslock_release(&slb_mcslock);
+		}
+		else {
+			spinlock_release(&slb_spinlock);
+		}
+
+		getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+		ns = rsecs * 1000000000 + rnsecs;
+		totalns += ns;
+		if (ns > maxns) {
+			maxns = ns;
+		}
+	}
+
+	spinlock_acquire(&slb_statlock);
+	slb_totalns += totalns;
+	if (maxns > slb_maxns) {
+		slb_maxns = maxns;
+	}
+	spinlock_release(&slb_statlock);
+
+	V(slb_done);
+}
+
+static
+void
+slbrun(const char *name, bool usemcs)
+{
+	unsigned i;
+	int result;
+
+	slb_totalns = 0;
+	slb_maxns = 0;
+	for (i=0; i<SLB_THREADS; i++) {
+		result = thread_fork("slbench", NULL, slbthread, NULL, usemcs);
+		if (result) {
+			panic("slbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<SLB_THREADS; i++) {
+		P(slb_done);
+	}
+
+	kprintf("%-9s %11llu %11u\n", name,
+		slb_totalns / (SLB_THREADS * SLB_LOOPS), slb_maxns);
+}
+
+int
+slbench(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	slb_done = sem_create("slb_done", 0);
+	if (slb_done == NULL) {
+		panic("slbench: Out of memory\n");
+	}
+
+	kprintf("%u threads, %u acquisitions each\n", SLB_THREADS, SLB_LOOPS);
+	kprintf("%-9s %11s %11s\n", "lock", "avg wait ns", "max wait ns");
+	slbrun("spinlock", false);
+	slbrun("mcslock", true);
+
+	sem_destroy(slb_done);
+
+	return 0;
+}
+
+/*
+ * Handoff benchmark: HOB_THREADS threads share HOB_TOTAL trips
+ * through a critical section long enough that waiters give up
+ * spinning and sleep. It runs with a lock and with a semaphore used
+ * as a mutex, each with and without handoff. For every change of
+ * holder we time the gap from the release to the next thread getting
+ * in (the wakeup-to-acquire latency), and we report the fewest and
+ * most trips any one thread made; a thread that keeps losing the
+ * race after being woken shows up as a small minimum.
+ */
+
+#define HOB_THREADS   8
+#define HOB_TOTAL     800
+#define HOB_INSIDE    2000
+#define HOB_OUTSIDE   200
+
+static struct lock *hob_lock;
+static struct semaphore *hob_sem;
+static struct semaphore *hob_done;
+static unsigned hob_trips;			/* protected by the lock/sem */
+static unsigned long hob_last;			/* thread that last got in */
+static time_t hob_relsecs;			/* when it let go */
+static uint32_t hob_relnsecs;
+static uint64_t hob_totalns;
+static uint32_t hob_maxns;
+static unsigned hob_switches;
+static unsigned hob_count[HOB_THREADS];
+
+static
+void
+hobthread(void *usesem, unsigned long num)
+{
+	time_t secs, rsecs;
+	uint32_t nsecs, rnsecs, ns;
+	bool done;
+	volatile int j;
+
+	done = false;
+	while (!done) {
+		if (usesem) {
+			P(hob_sem);
+		}
+		else {
+			lock_acquire(hob_lock);
+		}
+
+		gettime(&secs, &nsecs);
+		if (hob_trips > 0 && hob_last != num) {
+			getinterval(hob_relsecs, hob_relnsecs, secs, nsecs,
+				    &rsecs, &rnsecs);
+			ns = rsecs * 1000000000 + rnsecs;
+			hob_totalns += ns;
+			if (ns > hob_maxns) {
+				hob_maxns = ns;
+			}
+			hob_switches++;
+		}
+		if (hob_trips < HOB_TOTAL) {
+			hob_trips++;
+			hob_count[num]++;
+			for (j=0; j<HOB_INSIDE; j++);
+		}
+		else {
+			done = true;
+		}
+		hob_last = num;
+		gettime(&hob_relsecs, &hob_relnsecs);
+
+		if (usesem) {
+			V(hob_sem);
+		}
+		else {
+			lock_release(hob_lock);
+		}
+		for (j=0; j<HOB_OUTSIDE; j++);
+	}
+	V(hob_done);
+}
+
+static
+void
+hobrun(const char *name, bool usesem, bool handoff)
+{
+	unsigned i, mincount, maxcount;
+	int result;
+
+	if (usesem) {
+		sem_sethandoff(hob_sem, handoff);
+	}
+	else {
+		lock_sethandoff(hob_lock, handoff);
+	}
+	hob_trips = 0;
+	hob_totalns = 0;
+	hob_maxns = 0;
+	hob_switches = 0;
+	for (i=0; i<HOB_THREADS; i++) {
+		hob_count[i] = 0;
+	}
+
+	for (i=0; i<HOB_THREADS; i++) {
+		result = thread_fork("hobench", NULL, hobthread,
+				     usesem ? hob_sem : NULL, i);
+		if (result) {
+			panic("hobench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<HOB_THREADS; i++) {
+		P(hob_done);
+	}
+
+	mincount = maxcount = hob_count[0];
+	for (i=1; i<HOB_THREADS; i++) {
+		if (hob_count[i] < mincount) {
+			mincount = hob_count[i];
+		}
+		if (hob_count[i] > maxcount) {
+			maxcount = hob_count[i];
+		}
+	}
+
+	kprintf("%-9s %11llu %11u %9u %9u\n", name,
+		hob_switches ? hob_totalns / hob_switches : 0,
+		hob_maxns, mincount, maxcount);
+}
+
+int
+hobench(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	hob_lock = lock_create("hob_lock");
+	hob_sem = sem_create("hob_sem", 1);
+	hob_done = sem_create("hob_done", 0);
+	if (hob_lock == NULL || hob_sem == NULL || hob_done == NULL) {
+		panic("hobench: Out of memory\n");
+	}
+
+	kprintf("%u threads, %u trips in all\n", HOB_THREADS, HOB_TOTAL);
+	kprintf("%-9s %11s %11s %9s %9s\n", "mode", "avg gap ns",
+		"max gap ns", "min trips", "max trips");
+	hobrun("lock", false, false);
+	hobrun("lock/fifo", false, true);
+	hobrun("sem", true, false);
+	hobrun("sem/fifo", true, true);
+
+	sem_destroy(hob_done);
+	sem_destroy(hob_sem);
+	lock_destroy(hob_lock);
+
+	return 0;
+}
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
@@ -39,9 +40,8 @@
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * This is pretty primitive. Timed sleeps have the resolution of the
+ * timer clock, one tick every LT_GRANULARITY usec.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -51,27 +51,54 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	64	/* MLFQ priority boost every 64. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
- */
-static struct wchan *lbolt;
-/*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * Timed sleeps.
+ *
+ * Each sleeping thread has a struct timeout with its deadline, in
+ * timer ticks, on a hierarchical timer wheel. Level 0 has a slot for
+ * each of the next TW_SLOTS ticks; each slot at level 1 covers
+ * TW_SLOTS ticks, each at level 2 TW_SLOTS^2, and so on. Every tick
+ * timerclock() takes the timeouts in the current level 0 slot, which
+ * are exactly the ones due now, and wakes only those threads. When
+ * level 0 wraps around, the next level 1 slot is "cascaded": its
+ * timeouts are put back on the wheel, which now lands them on level
+ * 0 (or, in turn, the next level down). So adding a timeout and
+ * expiring one are both O(1), and each timeout is cascaded at most
+ * TW_LEVELS-1 times.
+ *
+ * Deadlines further out than the wheel reaches (about two days) are
+ * pulled in to its far edge; the sleeper just goes back to sleep
+ * when it wakes early.
+ *
+ * Sleepers wait on timeout_wchan. A sleeper keeps the channel locked
+ * from before it puts its timeout on the wheel until it's asleep, so
+ * by the time timerclock can see the timeout the thread is on the
+ * channel and wchan_wakethread can take it off. Lock order is
+ * timeout_wchan, then tw_lock.
  */
-static struct wchan *minibolt;
 
-/* 
- * number of minibolts per second
- */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+#define TW_BITS		6
+#define TW_SLOTS	(1U << TW_BITS)
+#define TW_MASK		(TW_SLOTS - 1)
+#define TW_LEVELS	4
+#define TW_MAXDELTA	((1U << (TW_BITS * TW_LEVELS)) - 1)
 
-/*
- * minibolt countdown
- */
-static int minicount;
+/* timer ticks per second */
+#define TICKS_PER_SECOND	(1000000 / LT_GRANULARITY)
+
+struct timeout {
+	unsigned to_expires;		/* Deadline, in timer ticks */
+	struct thread *to_thread;	/* Who to wake */
+	struct timeout *to_next;	/* Next in wheel slot */
+};
+
+static struct spinlock tw_lock;
+static struct timeout *tw_wheel[TW_LEVELS][TW_SLOTS];
+static unsigned tw_now;			/* Next tick to process */
+static volatile unsigned timerticks;	/* Ticks so far */
+static struct wchan *timeout_wchan;
 
 /*
  * Setup.
@@ -79,17 +106,67 @@ static int minicount;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	spinlock_init(&tw_lock);
+	timeout_wchan = wchan_create("timeout");
+	if (timeout_wchan == NULL) {
+		panic("Couldn't create timeout wchan\n");
 	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	timerticks = 0;
+	tw_now = 1;
+	/* we assume TICKS_PER_SECOND > 0 */
+	KASSERT(TICKS_PER_SECOND > 0);
+}
+
+/*
+ * Put a timeout on the wheel, relative to tw_now. Deadlines already
+ * past go in the current slot. The caller must hold tw_lock.
+ */
+static
+void
+tw_add(struct timeout *to)
+{
+	unsigned delta, level, slot;
+
+	KASSERT(spinlock_do_i_hold(&tw_lock));
+
+	delta = to->to_expires - tw_now;
+	if ((int)delta < 0) {
+		to->to_expires = tw_now;
+		delta = 0;
+	}
+	else if (delta > TW_MAXDELTA) {
+		to->to_expires = tw_now + TW_MAXDELTA;
+		delta = TW_MAXDELTA;
+	}
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (1U << (TW_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	slot = (to->to_expires >> (TW_BITS * level)) & TW_MASK;
+	to->to_next = tw_wheel[level][slot];
+	tw_wheel[level][slot] = to;
+}
+
+/*
+ * Re-add everything in slot SLOT of level LEVEL, which moves it down
+ * a level. Returns SLOT, so the caller can tell when this level has
+ * wrapped too.
+ */
+static
+unsigned
+tw_cascade(unsigned level, unsigned slot)
+{
+	struct timeout *to, *next;
+
+	to = tw_wheel[level][slot];
+	tw_wheel[level][slot] = NULL;
+	for (; to != NULL; to = next) {
+		next = to->to_next;
+		tw_add(to);
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	return slot;
 }
 
 /*
@@ -99,18 +176,52 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
+	struct timeout *expired, *to, *next;
+	struct thread *t;
+	unsigned slot, level;
+
+	expired = NULL;
+
+	spinlock_acquire(&tw_lock);
+	timerticks++;
+	while ((int)(timerticks - tw_now) >= 0) {
+		slot = tw_now & TW_MASK;
+		if (slot == 0) {
+			for (level = 1; level < TW_LEVELS; level++) {
+				if (tw_cascade(level,
+				      (tw_now >> (TW_BITS * level)) & TW_MASK)
+				    != 0) {
+					break;
+				}
+			}
+		}
+		tw_now++;
+
+		/* Everything left in this slot is due. */
+		for (to = tw_wheel[0][slot]; to != NULL; to = next) {
+			next = to->to_next;
+			to->to_next = expired;
+			expired = to;
+		}
+		tw_wheel[0][slot] = NULL;
+	}
+	spinlock_release(&tw_lock);
+
+	/*
+	 * The timeouts live on their threads' stacks, so don't touch
+	 * one again after waking its thread.
+	 */
+	for (to = expired; to != NULL; to = next) {
+		next = to->to_next;
+		t = to->to_thread;
+		wchan_wakethread(timeout_wchan, t);
 	}
 }
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code. Idle processors stop their tick (see thread_switch) and don't
+ * get these.
  */
 void
 hardclock(void)
@@ -123,10 +234,28 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	thread_tick();
+}
+
+/*
+ * Sleep until timerticks reaches DEADLINE.
+ */
+static
+void
+clocksleep_until(unsigned deadline)
+{
+	struct timeout to;
+
+	while ((int)(deadline - timerticks) > 0) {
+		to.to_expires = deadline;
+		to.to_thread = curthread;
+
+		wchan_lock(timeout_wchan);
+		spinlock_acquire(&tw_lock);
+		tw_add(&to);
+		spinlock_release(&tw_lock);
+		wchan_sleep(timeout_wchan);
 	}
-	thread_yield();
 }
 
 /*
@@ -135,11 +264,10 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	if (num_secs > 0) {
+		clocksleep_until(timerticks +
+				 (unsigned)num_secs * TICKS_PER_SECOND);
+	}
 }
 
 /*
@@ -149,9 +277,40 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	if (num_ticks > 0) {
+		clocksleep_until(timerticks + (unsigned)num_ticks);
+	}
+}
+
+/*
+ * Suspend execution for at least SECS seconds plus NSECS nanoseconds,
+ * rounded up to whole timer ticks. The current tick is already partly
+ * over, so it doesn't count: we wait one tick more than that.
+ *
+ * Deadlines are only compared within TW_MAXDELTA ticks of now, so a
+ * longer sleep is taken in pieces of at most that, each ending where
+ * the last one was due to end.
+ */
+void
+clocknanosleep(time_t secs, uint32_t nsecs)
+{
+	uint64_t ticks;
+	unsigned deadline, chunk;
+
+	KASSERT(secs >= 0);
+	KASSERT(nsecs < 1000000000);
+
+	if (secs == 0 && nsecs == 0) {
+		return;
+	}
+	ticks = (uint64_t)secs * TICKS_PER_SECOND +
+		DIVROUNDUP(nsecs, LT_GRANULARITY * 1000) + 1;
+
+	deadline = timerticks;
+	while (ticks > 0) {
+		chunk = ticks > TW_MAXDELTA ? TW_MAXDELTA : (unsigned)ticks;
+		deadline += chunk;
+		clocksleep_until(deadline);
+		ticks -= chunk;
+	}
 }
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * MCS locks. See mcslock.h.
+ *
+ * The queue is a linked list of waiters' nodes; ml_tail points at the
+ * last one. To get in line, swap your node into ml_tail, link it from
+ * whatever node was there before, and spin on your own mn_wait until
+ * the previous holder clears it. To release, hand off to mn_next, or
+ * if there's nobody, swing ml_tail back to NULL - unless someone has
+ * just swapped themselves in and not linked up yet, in which case
+ * wait for them to.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <mcslock.h>
+#include <current.h>	/* for curcpu */
+
+/* Nodes for use before curcpu exists (only one cpu is running then) */
+static struct mcsnode mcs_bootnodes[MCS_NODES];
+
+void
+mcsnodes_init(struct mcsnode *nodes)
+{
+	unsigned i;
+
+	for (i=0; i<MCS_NODES; i++) {
+		nodes[i].mn_next = NULL;
+		nodes[i].mn_wait = false;
+		nodes[i].mn_inuse = false;
+	}
+}
+
+/*
+ * Get a free node on this cpu. Interrupts are off, so nothing else
+ * on this cpu can be in here at the same time.
+ */
+static
+struct mcsnode *
+mcsnode_get(void)
+{
+	struct mcsnode *nodes;
+	unsigned i;
+
+	nodes = CURCPU_EXISTS() ? curcpu->c_mcsnodes : mcs_bootnodes;
+	for (i=0; i<MCS_NODES; i++) {
+		if (!nodes[i].mn_inuse) {
+			nodes[i].mn_inuse = true;
+			return &nodes[i];
+		}
+	}
+	panic("mcslock: cpu holds more than %d mcslocks\n", MCS_NODES);
+	return NULL;
+}
+
+void
+mcslock_init(struct mcslock *ml)
+{
+	ml->ml_tail = NULL;
+	ml->ml_node = NULL;
+	ml->ml_holder = NULL;
+}
+
+void
+mcslock_cleanup(struct mcslock *ml)
+{
+	KASSERT(ml->ml_holder == NULL);
+	KASSERT(ml->ml_tail == NULL);
+}
+
+/*
+ * Get the lock. As with spinlocks, disable interrupts first.
+ */
+void
+mcslock_acquire(struct mcslock *ml)
+{
+	struct mcsnode *me, *pred;
+	struct cpu *mycpu;
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		if (ml->ml_holder == mycpu) {
+			panic("Deadlock on mcslock %p\n", ml);
+		}
+	}
+	else {
+		mycpu = NULL;
+	}
+
+	me = mcsnode_get();
+	me->mn_next = NULL;
+	me->mn_wait = true;
+
+	pred = spinlock_ptr_swap((void *volatile *)&ml->ml_tail, me);
+	if (pred != NULL) {
+		pred->mn_next = me;
+		while (me->mn_wait) {
+			/* spin on our own node */
+		}
+	}
+
+	ml->ml_node = me;
+	ml->ml_holder = mycpu;
+}
+
+/*
+ * Release the lock.
+ */
+void
+mcslock_release(struct mcslock *ml)
+{
+	struct mcsnode *me;
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		KASSERT(ml->ml_holder == curcpu->c_self);
+	}
+
+	me = ml->ml_node;
+	KASSERT(me != NULL);
+	ml->ml_node = NULL;
+	ml->ml_holder = NULL;
+
+	if (me->mn_next == NULL) {
+		if (spinlock_ptr_cas((void *volatile *)&ml->ml_tail,
+				     me, NULL)) {
+			/* Nobody waiting. */
+			goto done;
+		}
+		/* Someone's joining the queue; wait for the link. */
+		while (me->mn_next == NULL) {
+			/* spin */
+		}
+	}
+	me->mn_next->mn_wait = false;
+
+ done:
+	me->mn_inuse = false;
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+/*
+ * Check if the current cpu holds the lock.
+ */
+bool
+mcslock_do_i_hold(struct mcslock *ml)
+{
+	if (!CURCPU_EXISTS()) {
+		return true;
+	}
+
+	/* Assume we can read ml_holder atomically enough for this to work */
+	return (ml->ml_holder == curcpu->c_self);
+}
@@ -33,17 +33,57 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
+#include <kmemcache.h>
 #include <synch.h>
 
+/*
+ * Object caches for the primitives. The constructors set up the
+ * parts that survive being freed back to the cache (the wchan and
+ * spinlock); the create functions only fill in the name and state.
+ * The wchan is created on the name buffer, so it picks up each new
+ * name without being recreated.
+ */
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+static struct kmem_cache *rwlock_cache;
+
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	sem->sem_name[0] = 0;
+	sem->sem_wchan = wchan_create(sem->sem_name);
+	if (sem->sem_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_destroy(sem->sem_wchan);
+}
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
@@ -51,26 +91,14 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = kmem_cache_alloc(sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
-        sem->sem_name = kstrdup(name);
-        if (sem->sem_name == NULL) {
-                kfree(sem);
-                return NULL;
-        }
-
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
+	snprintf(sem->sem_name, sizeof(sem->sem_name), "%s", name);
         sem->sem_count = initial_count;
+	sem->sem_handoff = false;
 
         return sem;
 }
@@ -80,11 +108,9 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
-        kfree(sem->sem_name);
-        kfree(sem);
+	/* wchan_destroy would have asserted this; the wchan is kept now */
+	KASSERT(wchan_isempty(sem->sem_wchan));
+        kmem_cache_free(sem_cache, sem);
 }
 
 void 
@@ -115,13 +141,19 @@ P(struct semaphore *sem)
 		 * textbooks semaphores must for some reason have
 		 * strict ordering. Too bad. :-)
 		 *
-		 * Exercise: how would you implement strict FIFO
-		 * ordering?
+		 * Unless the semaphore is in handoff mode, that is.
+		 * Then V only counts when nobody is asleep, so a
+		 * nonzero count means there's nobody to jump ahead
+		 * of, and being woken up means we've been given a
+		 * unit that never went through sem_count.
 		 */
 		wchan_lock(sem->sem_wchan);
 		spinlock_release(&sem->sem_lock);
                 wchan_sleep(sem->sem_wchan);
 
+		if (sem->sem_handoff) {
+			return;
+		}
 		spinlock_acquire(&sem->sem_lock);
         }
         KASSERT(sem->sem_count > 0);
@@ -136,42 +168,77 @@ V(struct semaphore *sem)
 
 	spinlock_acquire(&sem->sem_lock);
 
-        sem->sem_count++;
-        KASSERT(sem->sem_count > 0);
-	wchan_wakeone(sem->sem_wchan);
+	if (sem->sem_handoff) {
+		if (wchan_wakeone(sem->sem_wchan) == NULL) {
+			sem->sem_count++;
+		}
+	}
+	else {
+		sem->sem_count++;
+		KASSERT(sem->sem_count > 0);
+		wchan_wakeone(sem->sem_wchan);
+	}
 
 	spinlock_release(&sem->sem_lock);
 }
 
+void
+sem_sethandoff(struct semaphore *sem, bool handoff)
+{
+	KASSERT(sem != NULL);
+	KASSERT(wchan_isempty(sem->sem_wchan));
+
+	sem->sem_handoff = handoff;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Lock.
 
+static
+int
+lock_ctor(void *obj)
+{
+        struct lock *lock = obj;
+
+        lock->lk_name[0] = 0;
+        lock->lock_wchan = wchan_create(lock->lk_name);
+        if (lock->lock_wchan == NULL) {
+                return ENOMEM;
+        }
+        spinlock_init(&lock->spin);
+        return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+        struct lock *lock = obj;
+
+        spinlock_cleanup(&lock->spin);
+        wchan_destroy(lock->lock_wchan);
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
-        lock->lk_name = kstrdup(name);
-        if (lock->lk_name == NULL) {
-                kfree(lock);
-                return NULL;
-        }
+        snprintf(lock->lk_name, sizeof(lock->lk_name), "%s", name);
         
         // add stuff here as needed
-        lock->held = false;
-        lock->lock_wchan = wchan_create(lock->lk_name);
-        if (lock->lock_wchan == NULL) {
-            kfree(lock->lk_name);
-            kfree(lock);
-            return NULL;
-        }
-        spinlock_init(&lock->spin);
+        spinlock_data_set(&lock->lk_word, 0);
+        lock->owner = NULL;
+        lock->lk_waiters = 0;
+        lock->lk_heldnext = NULL;
+        lock->lk_piwaiters = NULL;
+        lock->lk_handoff = false;
                     
         return lock;
 }
@@ -182,12 +249,255 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
         // add stuff here as needed
-        /* wchan_cleanup will assert if anyone's waiting on it */
-    spinlock_cleanup(&lock->spin);
-    wchan_destroy(lock->lock_wchan);
+        KASSERT(spinlock_data_get(&lock->lk_word) == 0);
+        KASSERT(lock->lk_waiters == 0);
+        KASSERT(lock->lk_piwaiters == NULL);
+        /* wchan_destroy would have asserted this; the wchan is kept now */
+        KASSERT(wchan_isempty(lock->lock_wchan));
+
+        kmem_cache_free(lock_cache, lock);
+}
+
+/*
+ * Priority inheritance.
+ *
+ * A thread about to sleep on a lock puts itself on the lock's
+ * lk_piwaiters list and lends its priority to the owner; if the owner
+ * is itself asleep on a lock, the loan is passed on to that lock's
+ * owner, and so on (PI_MAXDEPTH bounds the walk, in case of a
+ * deadlock cycle). Spinners don't lend anything, since a spinner's
+ * holder is already running.
+ *
+ * A thread's t_priority is therefore the best of its t_basepriority
+ * and the priorities of the sleepers on the locks it holds. Each
+ * thread keeps a list of the locks it holds so that, when it lets one
+ * go, it can work that out again from what remains.
+ *
+ * Priorities are changed with thread_setpriority, so a holder that is
+ * waiting for a cpu when it is lent a better priority moves up its
+ * run queue at once rather than at its next turn.
+ *
+ * Everything but t_heldlocks, which only its own thread touches, is
+ * protected by pi_lock; run queue locks are taken inside it. One
+ * global lock is enough: it is only taken when somebody is about to
+ * sleep, or when a lock is released that has (or had) sleepers, both
+ * of which cost a context switch anyway.
+ */
+#define PI_MAXDEPTH 16
+
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER;
+
+/* Best priority among LOCK's sleepers, or WORST if there are none. */
+static
+int
+pi_waiterprio(struct lock *lock, int worst)
+{
+        struct thread *t;
+
+        KASSERT(spinlock_do_i_hold(&pi_lock));
+
+        for (t = lock->lk_piwaiters; t != NULL; t = t->t_pinext) {
+                if (t->t_priority < worst) {
+                        worst = t->t_priority;
+                }
+        }
+        return worst;
+}
+
+/* Recompute curthread's priority from the locks it still holds. */
+static
+void
+pi_recompute(void)
+{
+        struct lock *held;
+        int priority;
+
+        KASSERT(spinlock_do_i_hold(&pi_lock));
+
+        priority = curthread->t_basepriority;
+        for (held = curthread->t_heldlocks; held != NULL;
+             held = held->lk_heldnext) {
+                priority = pi_waiterprio(held, priority);
+        }
+        if (priority != curthread->t_priority) {
+                thread_setpriority(curthread, priority);
+        }
+}
 
-        kfree(lock->lk_name);
-        kfree(lock);
+/*
+ * T is going to sleep on LOCK (or, for a CV wakeup, has just been
+ * moved there): queue it up and lend its priority down the chain.
+ */
+static
+void
+pi_block(struct lock *lock, struct thread *t)
+{
+        struct thread *owner;
+        int priority, depth;
+
+        spinlock_acquire(&pi_lock);
+
+        KASSERT(t->t_waitlock == NULL);
+        t->t_waitlock = lock;
+        t->t_pinext = lock->lk_piwaiters;
+        lock->lk_piwaiters = t;
+
+        priority = t->t_priority;
+        for (depth = 0; lock != NULL && depth < PI_MAXDEPTH; depth++) {
+                owner = lock->owner;
+                if (owner == NULL || owner->t_priority <= priority) {
+                        break;
+                }
+                thread_setpriority(owner, priority);
+                lock = owner->t_waitlock;
+        }
+
+        spinlock_release(&pi_lock);
+}
+
+/* Woken up: get off LOCK's list of sleepers. */
+static
+void
+pi_unblock(struct lock *lock)
+{
+        struct thread **tp;
+
+        spinlock_acquire(&pi_lock);
+
+        KASSERT(curthread->t_waitlock == lock);
+        for (tp = &lock->lk_piwaiters; *tp != curthread;
+             tp = &(*tp)->t_pinext) {
+                KASSERT(*tp != NULL);
+        }
+        *tp = curthread->t_pinext;
+        curthread->t_pinext = NULL;
+        curthread->t_waitlock = NULL;
+
+        spinlock_release(&pi_lock);
+}
+
+/*
+ * We've just got LOCK. Record it, and if others are still asleep on
+ * it, take over their loan from the previous holder.
+ */
+static
+void
+pi_acquired(struct lock *lock)
+{
+        int priority;
+
+        lock->owner = curthread;
+        lock->lk_heldnext = curthread->t_heldlocks;
+        curthread->t_heldlocks = lock;
+
+        if (lock->lk_piwaiters != NULL) {
+                spinlock_acquire(&pi_lock);
+                priority = pi_waiterprio(lock, curthread->t_priority);
+                if (priority != curthread->t_priority) {
+                        thread_setpriority(curthread, priority);
+                }
+                spinlock_release(&pi_lock);
+        }
+}
+
+/*
+ * Letting go of LOCK. Clearing the owner before looking at the
+ * sleepers and our own priority pairs with pi_block, which queues
+ * itself before looking at the owner: either it sees no owner and
+ * lends nothing, or we see what it lent and give it back.
+ */
+static
+void
+pi_released(struct lock *lock)
+{
+        struct lock **lp;
+
+        for (lp = &curthread->t_heldlocks; *lp != lock;
+             lp = &(*lp)->lk_heldnext) {
+                KASSERT(*lp != NULL);
+        }
+        *lp = lock->lk_heldnext;
+        lock->lk_heldnext = NULL;
+
+        lock->owner = NULL;
+        if (lock->lk_piwaiters != NULL ||
+            curthread->t_priority != curthread->t_basepriority) {
+                spinlock_acquire(&pi_lock);
+                pi_recompute();
+                spinlock_release(&pi_lock);
+        }
+}
+
+void
+lock_setpriority(struct thread *t, int priority)
+{
+        spinlock_acquire(&pi_lock);
+        if (t->t_priority == t->t_basepriority ||
+            priority < t->t_priority) {
+                thread_setpriority(t, priority);
+        }
+        /* Otherwise it's been lent better; it drops on release. */
+        t->t_basepriority = priority;
+        spinlock_release(&pi_lock);
+}
+
+/*
+ * A sleeper on LOCK has been woken. Returns true if it was handed the
+ * lock by lock_release, in which case the caller has it and must call
+ * pi_acquired; otherwise the caller must try again.
+ */
+static
+bool
+lock_woken(struct lock *lock)
+{
+        bool handed;
+
+        pi_unblock(lock);
+
+        spinlock_acquire(&lock->spin);
+        lock->lk_waiters--;
+        handed = (lock->owner == curthread);
+        spinlock_release(&lock->spin);
+
+        return handed;
+}
+
+/*
+ * Adaptive spinning. While the lock is held by a thread that is
+ * running on another cpu, keep trying for up to LOCK_SPIN_TRIES
+ * rounds rather than paying for two context switches; a running
+ * holder is likely to let go soon. Give up at once if the holder is
+ * asleep or waiting for a cpu, since then it won't.
+ *
+ * The owner is read without any lock, so it may have exited by the
+ * time we look at it. That's harmless: threads come from an object
+ * cache, and the kernel's direct-mapped memory doesn't fault, so the
+ * worst case is a stale t_state and one wasted round.
+ *
+ * Returns true if we got the lock.
+ */
+#define LOCK_SPIN_TRIES 1000
+
+static
+bool
+lock_spin(struct lock *lock)
+{
+        struct thread *owner;
+        unsigned i;
+
+        for (i = 0; i < LOCK_SPIN_TRIES; i++) {
+                owner = lock->owner;
+                if (owner != NULL &&
+                    (owner->t_state != S_RUN ||
+                     owner->t_cpu == curcpu->c_self)) {
+                        return false;
+                }
+                if (spinlock_data_get(&lock->lk_word) == 0 &&
+                    spinlock_data_testandset(&lock->lk_word) == 0) {
+                        return true;
+                }
+        }
+        return false;
 }
 
 void
@@ -205,18 +515,40 @@ lock_acquire(struct lock *lock)
          */
         KASSERT(curthread->t_in_interrupt == false);
 
+        /* Fast path: nobody has it. */
+        if (spinlock_data_testandset(&lock->lk_word) == 0) {
+                pi_acquired(lock);
+                return;
+        }
 
+        while (1) {
+                if (lock_spin(lock)) {
+                        break;
+                }
 
-        spinlock_acquire(&lock->spin);
-            while (lock->held) {
+                /*
+                 * Announce ourselves as a waiter before the last
+                 * try, so that either lock_release sees us and
+                 * does a wakeup, or we see its release.
+                 */
+                spinlock_acquire(&lock->spin);
+                lock->lk_waiters++;
+                if (spinlock_data_testandset(&lock->lk_word) == 0) {
+                        lock->lk_waiters--;
+                        spinlock_release(&lock->spin);
+                        break;
+                }
+                pi_block(lock, curthread);
                 wchan_lock(lock->lock_wchan);
                 spinlock_release(&lock->spin);
                 wchan_sleep(lock->lock_wchan);
-                spinlock_acquire(&lock->spin);
-            }
-            lock->held = true;
-            lock->owner = curthread;
-        spinlock_release(&lock->spin);
+
+                /* In handoff mode, the releaser made us the owner. */
+                if (lock_woken(lock)) {
+                        break;
+                }
+        }
+        pi_acquired(lock);
 }
 
 void
@@ -225,12 +557,44 @@ lock_release(struct lock *lock)
         // Write this
         KASSERT(lock != NULL);
         KASSERT(lock_do_i_hold(lock));
-        spinlock_acquire(&lock->spin);
-            lock->held = false;
-            lock->owner = NULL;
-            wchan_wakeone(lock->lock_wchan);
-        spinlock_release(&lock->spin);
+
+        pi_released(lock);
+
+        /*
+         * Handoff: leave lk_word set and make the longest sleeper the
+         * owner while we hold the spinlock it checks after waking.
+         * Only clear lk_word if it turns out nobody is asleep after
+         * all (a waiter may be counted but already awake).
+         */
+        if (lock->lk_handoff && lock->lk_waiters > 0) {
+                spinlock_acquire(&lock->spin);
+                lock->owner = wchan_wakeone(lock->lock_wchan);
+                if (lock->owner == NULL) {
+                        spinlock_data_set(&lock->lk_word, 0);
+                }
+                spinlock_release(&lock->spin);
+                return;
+        }
+
+        spinlock_data_set(&lock->lk_word, 0);
+
+        /* Only bother with the spinlock and wchan if someone's asleep. */
+        if (lock->lk_waiters > 0) {
+                spinlock_acquire(&lock->spin);
+                wchan_wakeone(lock->lock_wchan);
+                spinlock_release(&lock->spin);
+        }
 }
+void
+lock_sethandoff(struct lock *lock, bool handoff)
+{
+        KASSERT(lock != NULL);
+        KASSERT(spinlock_data_get(&lock->lk_word) == 0);
+        KASSERT(lock->lk_waiters == 0);
+
+        lock->lk_handoff = handoff;
+}
+
 bool
 lock_do_i_hold(struct lock *lock)
 {
@@ -246,29 +610,40 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+static
+int
+cv_ctor(void *obj)
+{
+        struct cv *cv = obj;
+
+        cv->cv_name[0] = 0;
+        cv->cv_wchan = wchan_create(cv->cv_name);
+        if (cv->cv_wchan == NULL) {
+                return ENOMEM;
+        }
+        return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+        struct cv *cv = obj;
+
+        wchan_destroy(cv->cv_wchan);
+}
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = kmem_cache_alloc(cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
-        cv->cv_name = kstrdup(name);
-        if (cv->cv_name==NULL) {
-                kfree(cv);
-                return NULL;
-        }
-        
-        // add stuff here as needed
-        cv->cv_wchan = wchan_create(cv->cv_name);
-        if (cv->cv_wchan == NULL) {
-            kfree(cv->cv_name);
-            kfree(cv);
-            return NULL;
-        }
+        snprintf(cv->cv_name, sizeof(cv->cv_name), "%s", name);
 
         return cv;
 }
@@ -279,9 +654,9 @@ cv_destroy(struct cv *cv)
         KASSERT(cv != NULL);
 
         // add stuff here as needed
-        wchan_destroy(cv->cv_wchan);
-        kfree(cv->cv_name);
-        kfree(cv);
+        /* wchan_destroy would have asserted this; the wchan is kept now */
+        KASSERT(wchan_isempty(cv->cv_wchan));
+        kmem_cache_free(cv_cache, cv);
 }
 
 void
@@ -293,17 +668,61 @@ cv_wait(struct cv *cv, struct lock *lock)
         wchan_lock(cv->cv_wchan);
         lock_release(lock);
         wchan_sleep(cv->cv_wchan);
+
+        /*
+         * If the signaller held the lock, we were moved onto the
+         * lock's sleepers (see cv_morph) and woken as one of them;
+         * finish off as lock_acquire would have.
+         */
+        if (curthread->t_waitlock == lock && lock_woken(lock)) {
+                pi_acquired(lock);
+                return;
+        }
         lock_acquire(lock);
 }
 
+/*
+ * Wait morphing. Waking a CV sleeper while its lock is held just
+ * sends it straight to sleep again in lock_acquire. Instead, move it
+ * from the CV's wait channel onto the lock's, as if it had already
+ * tried for the lock and gone to sleep, and let lock_release wake it
+ * in its turn. A broadcast then costs one wakeup per waiter as the
+ * lock is passed along, rather than a herd that all fight for it.
+ *
+ * Nobody can wake the lock's sleepers while we hold it, so the moved
+ * thread can be counted and queued for inheritance after the move.
+ * Returns false if there was nobody to move.
+ */
+static
+bool
+cv_morph(struct cv *cv, struct lock *lock)
+{
+        struct thread *t;
+
+        t = wchan_moveone(cv->cv_wchan, lock->lock_wchan);
+        if (t == NULL) {
+                return false;
+        }
+
+        spinlock_acquire(&lock->spin);
+        lock->lk_waiters++;
+        spinlock_release(&lock->spin);
+        pi_block(lock, t);
+        return true;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
         // Write this
         // If threads are blcoked on the signal condition variable, then one of
             // those threads is unblocked
-	(void)lock;  // suppress warning until code gets written
-    wchan_wakeone(cv->cv_wchan);
+        if (lock_do_i_hold(lock)) {
+                cv_morph(cv, lock);
+        }
+        else {
+                wchan_wakeone(cv->cv_wchan);
+        }
 }
 
 void
@@ -311,6 +730,190 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 {
 	// Write this
     // Like signal, but unblocks all threads that are blocked on the condition variable
-	(void)lock;  // suppress warning until code gets written
-    wchan_wakeall(cv->cv_wchan);
+        if (lock_do_i_hold(lock)) {
+                while (cv_morph(cv, lock)) {
+                        /* nothing */
+                }
+        }
+        else {
+                wchan_wakeall(cv->cv_wchan);
+        }
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+static
+int
+rwlock_ctor(void *obj)
+{
+        struct rwlock *rw = obj;
+
+        rw->rw_name[0] = 0;
+        rw->rw_readwchan = wchan_create(rw->rw_name);
+        if (rw->rw_readwchan == NULL) {
+                return ENOMEM;
+        }
+        rw->rw_writewchan = wchan_create(rw->rw_name);
+        if (rw->rw_writewchan == NULL) {
+                wchan_destroy(rw->rw_readwchan);
+                return ENOMEM;
+        }
+        spinlock_init(&rw->rw_lock);
+        return 0;
+}
+
+static
+void
+rwlock_dtor(void *obj)
+{
+        struct rwlock *rw = obj;
+
+        spinlock_cleanup(&rw->rw_lock);
+        wchan_destroy(rw->rw_writewchan);
+        wchan_destroy(rw->rw_readwchan);
+}
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+        struct rwlock *rw;
+
+        rw = kmem_cache_alloc(rwlock_cache);
+        if (rw == NULL) {
+                return NULL;
+        }
+
+        snprintf(rw->rw_name, sizeof(rw->rw_name), "%s", name);
+        rw->rw_readers = 0;
+        rw->rw_writerswaiting = 0;
+        rw->rw_writer = NULL;
+
+        return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rw->rw_readers == 0);
+        KASSERT(rw->rw_writer == NULL);
+        KASSERT(rw->rw_writerswaiting == 0);
+        KASSERT(wchan_isempty(rw->rw_readwchan));
+
+        kmem_cache_free(rwlock_cache, rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer != curthread);
+        while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0) {
+                wchan_lock(rw->rw_readwchan);
+                spinlock_release(&rw->rw_lock);
+                wchan_sleep(rw->rw_readwchan);
+                spinlock_acquire(&rw->rw_lock);
+        }
+        rw->rw_readers++;
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_readers > 0);
+        rw->rw_readers--;
+        if (rw->rw_readers == 0 && rw->rw_writerswaiting > 0) {
+                wchan_wakeone(rw->rw_writewchan);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer != curthread);
+        rw->rw_writerswaiting++;
+        while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+                wchan_lock(rw->rw_writewchan);
+                spinlock_release(&rw->rw_lock);
+                wchan_sleep(rw->rw_writewchan);
+                spinlock_acquire(&rw->rw_lock);
+        }
+        rw->rw_writerswaiting--;
+        rw->rw_writer = curthread;
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer == curthread);
+        rw->rw_writer = NULL;
+        if (rw->rw_writerswaiting > 0) {
+                wchan_wakeone(rw->rw_writewchan);
+        }
+        else {
+                wchan_wakeall(rw->rw_readwchan);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer == curthread);
+        rw->rw_writer = NULL;
+        rw->rw_readers++;
+        if (rw->rw_writerswaiting == 0) {
+                wchan_wakeall(rw->rw_readwchan);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        return rw->rw_writer == curthread;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Bootstrap.
+
+void
+synch_bootstrap(void)
+{
+	sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore),
+				      sem_ctor, sem_dtor);
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       lock_ctor, lock_dtor);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv),
+				     cv_ctor, cv_dtor);
+	rwlock_cache = kmem_cache_create("rwlock", sizeof(struct rwlock),
+					 rwlock_ctor, rwlock_dtor);
+	if (sem_cache == NULL || lock_cache == NULL || cv_cache == NULL ||
+	    rwlock_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
 }
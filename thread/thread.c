@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmemcache.h>
 
 #include "opt-synchprobs.h"
 
@@ -111,6 +112,36 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Thread structures come from an object cache. The parts that are
+ * the same for every thread when it's not in use (the list node and
+ * the machine-dependent state) are set up once by the constructor and
+ * stay that way across reuse. The stack is not kept; it's much bigger
+ * than the thread structure and belongs back in the general pool.
+ */
+static struct kmem_cache *thread_cache;
+
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,27 +154,38 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	/* (t_machdep and t_listnode are set up by thread_ctor) */
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 
+	/* Scheduler fields */
+	thread->t_priority = 0;
+	thread->t_mlfq_level = 0;
+	thread->t_mlfq_ticks = 0;
+	thread->t_lastrun = 0;
+
+	/* Priority inheritance fields */
+	thread->t_basepriority = 0;
+	thread->t_waitlock = NULL;
+	thread->t_pinext = NULL;
+	thread->t_heldlocks = NULL;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -168,6 +210,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,13 +223,20 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_stolen = 0;
+	c->c_hotskips = 0;
+	mcsnodes_init(c->c_mcsnodes);
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	c->c_nrunnable = 0;
+	for (i=0; i<MLFQ_LEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	mcslock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_gen = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -252,14 +302,15 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
+	/* thread_dtor runs the cleanups; check them now anyway */
+	KASSERT(thread->t_listnode.tln_next == NULL);
+	KASSERT(thread->t_listnode.tln_prev == NULL);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -289,6 +340,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +356,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<MLFQ_LEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_nrunnable = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -351,6 +407,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -426,6 +488,288 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Cache affinity.
+ *
+ * A thread stays with the cpu it last ran on (t_cpu): wakeups put it
+ * back on that cpu's run queue, and the only thing that moves it is
+ * work stealing. A thread that ran less than CACHE_HOT_HARDCLOCKS
+ * ago probably still has its working set in that cpu's cache, so it
+ * isn't stolen even if the thief is idle; it will be soon enough.
+ * System/161 does not model caches, but trace161 configurations can.
+ */
+#define CACHE_HOT_HARDCLOCKS	2
+
+/*
+ * Priorities.
+ *
+ * t_priority is a nice value: lower numbers are more important, and
+ * 0 is the default. Within each MLFQ level the run queue is kept
+ * sorted by it, so the dispatcher takes the most important thread
+ * at the highest level, and threads of equal priority still go round
+ * robin. Niced threads (priority above 0) also never rise above
+ * level 1, so they can't compete with foreground work that blocks
+ * often.
+ */
+#define MLFQ_TOPLEVEL(t)	((t)->t_priority > 0 ? 1U : 0U)
+
+/*
+ * Put T on TL behind every thread of the same or better priority.
+ * Searching from the back makes the usual all-equal case O(1).
+ */
+static
+void
+runqueue_insert(struct threadlist *tl, struct thread *t)
+{
+	struct thread *t2;
+
+	THREADLIST_FORALL_REV(t2, *tl) {
+		if (t2->t_priority <= t->t_priority) {
+			threadlist_insertafter(tl, t2, t);
+			return;
+		}
+	}
+	threadlist_addhead(tl, t);
+}
+
+/*
+ * Run queue helpers. The caller must hold C's run queue lock.
+ *
+ * These keep c_nrunnable in step with the queues, so everything that
+ * puts threads on or takes them off a run queue should use them.
+ */
+
+/* Number of threads on all of C's run queues. */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	return c->c_nrunnable;
+}
+
+/* Put T on the queue for its level, in priority order. */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_mlfq_level < MLFQ_LEVELS);
+	runqueue_insert(&c->c_runqueue[t->t_mlfq_level], t);
+	c->c_nrunnable++;
+}
+
+/* Take the next thread to run: the first one at the highest level. */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<MLFQ_LEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_nrunnable--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take a thread that can be moved to another cpu: the one that would
+ * run last (the last one at the lowest level) whose cache state on C
+ * has probably gone cold. Hot threads are counted in *HOTSKIPS and
+ * left where they are.
+ */
+static
+struct thread *
+runqueue_remcold(struct cpu *c, unsigned *hotskips)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=MLFQ_LEVELS; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			if (t == c->c_curthread) {
+				/*
+				 * C went idle with T still as its
+				 * curthread, and T has since been woken
+				 * but not yet switched back to. It's
+				 * still running on C's stack, so leave
+				 * it alone.
+				 */
+				continue;
+			}
+			if (c->c_hardclocks - t->t_lastrun <
+			    CACHE_HOT_HARDCLOCKS) {
+				(*hotskips)++;
+				continue;
+			}
+			threadlist_remove(&c->c_runqueue[i], t);
+			c->c_nrunnable--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Change T's priority, keeping the scheduler's view of it consistent.
+ * If T is waiting on a run queue it is re-sorted there; and if its
+ * priority improved it moves up to its top level, so that a lock
+ * holder that has just been lent a better priority doesn't sit
+ * behind hogs at a higher level until the next boost. A thread that
+ * got worse than its level allows moves down to its top level.
+ * A sleeping thread just takes the new value and is queued by it
+ * when it wakes.
+ *
+ * T's cpu can change under us if it is being stolen, so lock what we
+ * think is its cpu and check again. Mid-steal, T is ready but on no
+ * run queue; then the thief queues it with the new values.
+ */
+void
+thread_setpriority(struct thread *t, int priority)
+{
+	struct cpu *c;
+	bool improved, queued;
+	unsigned top;
+
+	while (1) {
+		c = t->t_cpu;
+		if (c == NULL) {
+			/* Not started yet; nothing else to fix up. */
+			t->t_priority = priority;
+			return;
+		}
+		mcslock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		mcslock_release(&c->c_runqueue_lock);
+	}
+
+	/*
+	 * thread_make_runnable sets S_READY under the run queue lock,
+	 * so a ready thread with a list node is on our run queue (a
+	 * sleeping one's node is on a wait channel instead).
+	 */
+	queued = t->t_state == S_READY && t->t_listnode.tln_prev != NULL;
+	if (queued) {
+		threadlist_remove(&c->c_runqueue[t->t_mlfq_level], t);
+		c->c_nrunnable--;
+	}
+
+	improved = priority < t->t_priority;
+	t->t_priority = priority;
+	if (t->t_state == S_READY || t->t_state == S_RUN) {
+		top = MLFQ_TOPLEVEL(t);
+		if (t->t_mlfq_level < top ||
+		    (improved && t->t_mlfq_level > top)) {
+			t->t_mlfq_level = top;
+			t->t_mlfq_ticks = 0;
+		}
+	}
+
+	if (queued) {
+		runqueue_add(c, t);
+	}
+	mcslock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Send IPI_UNIDLE to one idle cpu other than BUSY, if there is one.
+ * c_isidle is read without locks; if we're wrong either way the cost
+ * is a spurious wakeup or a thread that waits for BUSY to get to it.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * Work stealing.
+ *
+ * When a cpu runs out of threads it tries to take one from whichever
+ * other cpu has the most waiting, before going idle. Victims are
+ * picked by reading c_nrunnable without the lock; the count may be
+ * stale, but that only costs a wasted lock acquisition or a missed
+ * steal. Idle cpus normally have no tick, so thread_make_runnable
+ * wakes one with thread_kick_idle whenever a busy cpu gets a thread
+ * queued, and it comes back through here. If all we found was
+ * cache-hot, thread_switch keeps the tick going so we come back
+ * once it has cooled. Only one run queue lock
+ * is ever held at a time here, so there is no lock ordering to get
+ * wrong.
+ *
+ * We take the victim's last thread whose cache state is cold, the
+ * one it would have got to latest. Pulling only when idle means we
+ * never move a thread away from a cpu that would have run it soon
+ * anyway.
+ *
+ * Called with interrupts off and without our own run queue lock.
+ * Returns true if a thread was put on our run queue.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, n, most;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			/* An idle cpu is about to run its own threads. */
+			continue;
+		}
+		n = c->c_nrunnable;
+		if (n > most) {
+			most = n;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	mcslock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remcold(victim, &curcpu->c_hotskips);
+	mcslock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	/*
+	 * T is on no run queue now, and nobody else touches a ready
+	 * thread's t_cpu, so it's safe to move it over unlocked.
+	 */
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	t->t_cpu = curcpu->c_self;
+	curcpu->c_stolen++;
+	mcslock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_add(curcpu, t);
+	mcslock_release(&curcpu->c_runqueue_lock);
+	return true;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -443,14 +787,20 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	if (already_have_lock) {
 		/* The target thread's cpu should be already locked. */
-		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+		KASSERT(mcslock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
 	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		mcslock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
+	/*
+	 * Mark it ready while the run queue is locked, so that anyone
+	 * who holds the lock can tell a queued thread from one asleep
+	 * on a wait channel by its state alone.
+	 */
+	target->t_state = S_READY;
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,9 +808,18 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (target != curthread) {
+		/*
+		 * Target is busy, so there's a thread waiting there.
+		 * Idle cpus have no tick to make them look for work
+		 * (see thread_switch), so wake one up to steal it.
+		 * (Not when we're just requeueing ourselves.)
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
-		spinlock_release(&targetcpu->c_runqueue_lock);
+		mcslock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
@@ -506,6 +865,13 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	/* It has no cache state anywhere yet; let anyone take it. */
+	newthread->t_lastrun = newthread->t_cpu->c_hardclocks -
+		CACHE_HOT_HARDCLOCKS;
+	/* Inherit the base priority, not anything we've been lent. */
+	newthread->t_priority = curthread->t_basepriority;
+	newthread->t_basepriority = curthread->t_basepriority;
+	newthread->t_mlfq_level = MLFQ_TOPLEVEL(newthread);
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -548,6 +914,8 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	unsigned hotskips;
+	bool tickless;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -571,15 +939,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	thread_checkstack(cur);
 
 	/* Lock the run queue. */
-	spinlock_acquire(&curcpu->c_runqueue_lock);
+	mcslock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (newstate == S_READY && runqueue_count(curcpu) == 0) {
+		mcslock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Note when it last ran, for cache affinity. */
+	cur->t_lastrun = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -588,6 +959,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		/*
+		 * Blocking before the quantum ran out looks
+		 * interactive; move up a level.
+		 */
+		if (cur->t_mlfq_level > MLFQ_TOPLEVEL(cur)) {
+			cur->t_mlfq_level--;
+		}
+		cur->t_mlfq_ticks = 0;
+
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -601,7 +981,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		 * reasons. One is that the caller is unlikely to need
 		 * or want it locked and if it does can lock it itself
 		 * without racing. Exercise: what's the other?)
+		 *
+		 * Set t_state before unlocking too: once we're on the
+		 * list, wchan_wakethread and wchan_moveone on another
+		 * cpu can find us, and shouldn't see us as S_RUN. (The
+		 * run queue lock still keeps them from actually making
+		 * us runnable until we're off this cpu.)
 		 */
+		cur->t_state = S_SLEEP;
 		threadlist_addtail(&wc->wc_threads, cur);
 		wchan_unlock(wc);
 		break;
@@ -613,7 +1000,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal
+	 * one from another cpu, and if that fails call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -631,15 +1019,43 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	tickless = false;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
-			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
-			spinlock_acquire(&curcpu->c_runqueue_lock);
+			mcslock_release(&curcpu->c_runqueue_lock);
+			hotskips = curcpu->c_hotskips;
+			if (!thread_steal()) {
+				/*
+				 * If the only threads around were
+				 * cache-hot, nobody will kick us when
+				 * they cool off, so keep the tick and
+				 * look again next hardclock.
+				 * Otherwise there's nothing to do
+				 * until an interrupt brings us some
+				 * work, so stop the tick rather than
+				 * wake up HZ times a second to find
+				 * nothing.
+				 */
+				if (curcpu->c_hotskips != hotskips) {
+					if (tickless) {
+						mainbus_tick_start();
+						tickless = false;
+					}
+				}
+				else if (!tickless) {
+					mainbus_tick_stop();
+					tickless = true;
+				}
+				cpu_idle();
+			}
+			mcslock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (tickless) {
+		mainbus_tick_start();
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -706,7 +1122,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = S_RUN;
 
 	/* Unlock the run queue. */
-	spinlock_release(&curcpu->c_runqueue_lock);
+	mcslock_release(&curcpu->c_runqueue_lock);
 
 	/* Activate our address space in the MMU. */
 	as_activate();
@@ -739,7 +1155,7 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	cur->t_state = S_RUN;
 
 	/* Release the runqueue lock acquired in thread_switch. */
-	spinlock_release(&curcpu->c_runqueue_lock);
+	mcslock_release(&curcpu->c_runqueue_lock);
 
 	/* Activate our address space in the MMU. */
 	as_activate();
@@ -822,139 +1238,130 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Each cpu has a multi-level feedback queue: MLFQ_LEVELS run queues,
+ * and the dispatcher always takes the first thread at the highest
+ * non-empty level. Threads start at level 0. A thread that uses up
+ * its whole quantum at a level (MLFQ_QUANTUM hardclocks, longer at
+ * lower levels) moves down one; a thread that blocks moves up one.
+ * So CPU hogs sink and threads that mostly wait for I/O, like the
+ * shell reading the console, stay near the top and get the cpu
+ * promptly when they wake.
+ *
+ * To keep the hogs from starving, schedule() periodically moves
+ * everything back up to the top level it is allowed (see
+ * MLFQ_TOPLEVEL).
  */
 
-void
-schedule(void)
-{
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
-}
+#define MLFQ_QUANTUM(level)	(1U << (level))	/* in hardclocks */
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Called from hardclock() on every tick.
  */
 void
-thread_consider_migration(void)
+thread_tick(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct thread *cur, *t;
+	bool preempt;
+	unsigned i;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	cur = curthread;
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	mcslock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* Nobody to charge; thread_yield would do nothing anyway. */
+		mcslock_release(&curcpu->c_runqueue_lock);
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	preempt = false;
+	if (curcpu->c_nrunnable == 0) {
+		/*
+		 * Nobody else to run; don't charge the quantum or
+		 * bother yielding.
+		 */
+		mcslock_release(&curcpu->c_runqueue_lock);
+		return;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
-
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
+	cur->t_mlfq_ticks++;
+	if (cur->t_mlfq_ticks >= MLFQ_QUANTUM(cur->t_mlfq_level)) {
+		/* Used its whole quantum: demote it, and round-robin. */
+		cur->t_mlfq_ticks = 0;
+		if (cur->t_mlfq_level < MLFQ_LEVELS - 1) {
+			cur->t_mlfq_level++;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		preempt = true;
+	}
+	for (i=0; i<cur->t_mlfq_level && !preempt; i++) {
+		if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+			/* Something more important is waiting. */
+			preempt = true;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	if (!preempt &&
+	    !threadlist_isempty(&curcpu->c_runqueue[cur->t_mlfq_level])) {
+		t = curcpu->c_runqueue[cur->t_mlfq_level].tl_head.tln_next
+			->tln_self;
+		if (t->t_priority < cur->t_priority) {
+			/* So is one at the same level with better priority. */
+			preempt = true;
+		}
+	}
+	mcslock_release(&curcpu->c_runqueue_lock);
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). It does the MLFQ
+ * priority boost: every thread on this cpu's run queues, and the
+ * current thread, goes back to its top level.
+ */
+void
+schedule(void)
+{
+	struct threadlist boosted;
+	struct thread *t;
+	unsigned i;
+
+	threadlist_init(&boosted);
+	mcslock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<MLFQ_LEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			threadlist_addtail(&boosted, t);
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+	while ((t = threadlist_remhead(&boosted)) != NULL) {
+		t->t_mlfq_level = MLFQ_TOPLEVEL(t);
+		t->t_mlfq_ticks = 0;
+		runqueue_insert(&curcpu->c_runqueue[t->t_mlfq_level], t);
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_mlfq_level = MLFQ_TOPLEVEL(curthread);
+		curthread->t_mlfq_ticks = 0;
+	}
+	mcslock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&boosted);
+}
+
+/*
+ * Print the scheduler counters for each cpu. The numbers are read
+ * without locks, so they're only a snapshot.
+ */
+void
+thread_printcpustats(void)
+{
+	struct cpu *c;
+	unsigned i;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	kprintf("cpu  hardclocks  runnable  stolen  hotskips\n");
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u  %10u  %8u  %6u  %8u\n", c->c_number,
+			c->c_hardclocks, c->c_nrunnable, c->c_stolen,
+			c->c_hotskips);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1029,9 +1436,9 @@ wchan_sleep(struct wchan *wc)
 }
 
 /*
- * Wake up one thread sleeping on a wait channel.
+ * Wake up one thread sleeping on a wait channel, and return it.
  */
-void
+struct thread *
 wchan_wakeone(struct wchan *wc)
 {
 	struct thread *target;
@@ -1047,10 +1454,49 @@ wchan_wakeone(struct wchan *wc)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
 
 	thread_make_runnable(target, false);
+	return target;
+}
+
+/*
+ * Wake up a particular thread sleeping on a wait channel.
+ */
+void
+wchan_wakethread(struct wchan *wc, struct thread *target)
+{
+	spinlock_acquire(&wc->wc_lock);
+	KASSERT(target->t_wchan_name == wc->wc_name);
+	threadlist_remove(&wc->wc_threads, target);
+	spinlock_release(&wc->wc_lock);
+
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Move a thread from one wait channel to another. Always lock FROM
+ * first; the only user moves from a CV's channel to its lock's.
+ */
+struct thread *
+wchan_moveone(struct wchan *from, struct wchan *to)
+{
+	struct thread *target;
+
+	spinlock_acquire(&from->wc_lock);
+	target = threadlist_remhead(&from->wc_threads);
+	if (target != NULL) {
+		/* thread_switch sets this before unlocking FROM. */
+		KASSERT(target->t_state == S_SLEEP);
+		spinlock_acquire(&to->wc_lock);
+		threadlist_addtail(&to->wc_threads, target);
+		target->t_wchan_name = to->wc_name;
+		spinlock_release(&to->wc_lock);
+	}
+	spinlock_release(&from->wc_lock);
+
+	return target;
 }
 
 /*
@@ -1140,12 +1586,16 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Queue a shootdown on TARGET and poke it. Caller holds TARGET's IPI lock.
+ */
+static
 void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+ipi_tlbshootdown_locked(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	int n;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
 	n = target->c_numshootdown;
 	if (n == TLBSHOOTDOWN_MAX) {
@@ -1158,10 +1608,59 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
+}
 
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	ipi_tlbshootdown_locked(target, mapping);
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_sync(const struct tlbshootdown *mapping)
+{
+	unsigned i, gen;
+	struct cpu *c;
+	int spl;
+
+	KASSERT(curthread->t_curspl == 0);
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+
+		/*
+		 * We run at spl 0 between cpus, so we can be moved to
+		 * another cpu part way through; decide whether C is
+		 * the local one, and flush or queue for it, without
+		 * letting that happen. If we're moved to C after
+		 * queueing, the IPI just lands on us while we spin.
+		 */
+		spl = splhigh();
+		if (c == curcpu->c_self) {
+			vm_tlbshootdown(mapping);
+			splx(spl);
+			continue;
+		}
+
+		/*
+		 * The request is queued under the same lock hold as we
+		 * sample the generation, so the next batch the target
+		 * finishes is guaranteed to include it.
+		 */
+		spinlock_acquire(&c->c_ipi_lock);
+		gen = c->c_shootdown_gen;
+		ipi_tlbshootdown_locked(c, mapping);
+		spinlock_release(&c->c_ipi_lock);
+		splx(spl);
+
+		while (c->c_shootdown_gen == gen) {
+			/* spin */
+		}
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1177,12 +1676,12 @@ interprocessor_interrupt(void)
 	}
 	if (bits & (1U << IPI_OFFLINE)) {
 		/* offline request */
-		spinlock_acquire(&curcpu->c_runqueue_lock);
+		mcslock_acquire(&curcpu->c_runqueue_lock);
 		if (!curcpu->c_isidle) {
 			kprintf("cpu%d: offline: warning: not idle\n",
 				curcpu->c_number);
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		mcslock_release(&curcpu->c_runqueue_lock);
 		kprintf("cpu%d: offline.\n", curcpu->c_number);
 		cpu_halt();
 	}
@@ -1202,6 +1701,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_gen++;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -30,7 +30,13 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <mcslock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmemcache.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -117,85 +123,89 @@ struct pageref {
 
 ////////////////////////////////////////
 
+static struct pageref *sizebases[NSIZES];
+static struct pageref *allbase;
+
+////////////////////////////////////////
+
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
+ * Use one spinlock for the shared pool: the page lists above and the
+ * free lists inside the pages. Each cpu keeps a small cache of blocks
+ * in front of it (see the magazine code below) so that most kmalloc
+ * and kfree calls never take this lock at all.
+ */
+
+static struct mcslock kmalloc_spinlock = MCSLOCK_INITIALIZER;
+
+////////////////////////////////////////
+
+/*
+ * Pagerefs live in pages of their own, allocated with alloc_kpages
+ * as they're needed, so the amount of heap we can manage grows with
+ * the machine instead of being fixed at compile time. One page holds
+ * NPAGEREFS of them, enough to manage that many pages of heap.
  *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Free pagerefs are kept on a list (threaded through next_all, which
+ * isn't otherwise used while a pageref is free), so allocating and
+ * freeing one is O(1). Pageref pages are never given back; they're a
+ * small fraction of the heap they describe.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Getting a new pageref page has to be done without kmalloc_spinlock
+ * held, like any other call to alloc_kpages; so allocpageref just
+ * fails when the free list is empty and the caller deals with it.
  */
 
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *freepagerefs;
+static unsigned npagerefpages;
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *p;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
-	}
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
 
-	/* ran out */
-	return NULL;
+	p = freepagerefs;
+	if (p != NULL) {
+		freepagerefs = p->next_all;
+		p->next_all = NULL;
+	}
+	return p;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	p->pageaddr_and_blocktype = 0;
+	p->next_samesize = NULL;
+	p->next_all = freepagerefs;
+	freepagerefs = p;
 }
 
-////////////////////////////////////////
-
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
-
-////////////////////////////////////////
-
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Put a fresh page's worth of pagerefs on the free list.
  */
+static
+void
+addpagerefpage(vaddr_t page)
+{
+	struct pageref *prs;
+	unsigned i;
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
+
+	prs = (struct pageref *)page;
+	for (i=0; i<NPAGEREFS; i++) {
+		freepageref(&prs[i]);
+	}
+	npagerefpages++;
+}
 
 ////////////////////////////////////////
 
@@ -216,7 +226,7 @@ checksubpage(struct pageref *pr)
 	int blktype;
 	int nfree=0;
 
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
 
 	if (pr->freelist_offset == INVALID_OFFSET) {
 		KASSERT(pr->nfree==0);
@@ -255,19 +265,19 @@ checksubpages(void)
 	int i;
 	unsigned sc=0, ac=0;
 
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefpages * NPAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefpages * NPAGEREFS);
 		ac++;
 	}
 
@@ -290,7 +300,7 @@ dumpsubpage(struct pageref *pr)
 	uint32_t freemap[PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32)];
 
 	checksubpage(pr);
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
 
 	/* clear freemap[] */
 	for (i=0; i<sizeof(freemap)/sizeof(freemap[0]); i++) {
@@ -330,13 +340,17 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void dumpmagazines(void);
+static void dumpbigarenas(void);
+static void dumpheapstats(void);
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
 
 	/* print the whole thing with interrupts off */
-	spinlock_acquire(&kmalloc_spinlock);
+	mcslock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
@@ -344,7 +358,12 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
-	spinlock_release(&kmalloc_spinlock);
+	dumpmagazines();
+
+	mcslock_release(&kmalloc_spinlock);
+
+	dumpbigarenas();
+	dumpheapstats();
 }
 
 ////////////////////////////////////////
@@ -392,6 +411,124 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take one block off the free list of page PR, which must have one.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Find the page a block lives on. Returns NULL if it isn't one of ours.
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;	// pageref for page we're looking at
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	int blktype;		// index into sizes[] for pr
+
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
+
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+
+		/* check for corruption */
+		KASSERT(blktype>=0 && blktype<NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			return pr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Put a block back on the free list of its page PR. If that leaves
+ * the whole page free, the page is taken out of the allocator and
+ * true is returned; the caller should then pass *freepage to
+ * free_kpages once it has dropped kmalloc_spinlock.
+ */
+static
+bool
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr, vaddr_t *freepage)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(mcslock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+
+	/* Check for proper positioning and alignment */
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n",
+		      (void *)ptraddr);
+	}
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)ptraddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		*freepage = prpage;
+		return true;
+	}
+	return false;
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -399,6 +536,7 @@ subpage_kmalloc(size_t sz)
 	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t prrefpage;	// new page of pagerefs, if needed
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
@@ -409,7 +547,7 @@ subpage_kmalloc(size_t sz)
 	blktype = blocktype(sz);
 	sz = sizes[blktype];
 
-	spinlock_acquire(&kmalloc_spinlock);
+	mcslock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
@@ -423,29 +561,11 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 
 			checksubpages();
 
-			spinlock_release(&kmalloc_spinlock);
+			mcslock_release(&kmalloc_spinlock);
 			return retptr;
 		}
 	}
@@ -459,22 +579,30 @@ subpage_kmalloc(size_t sz)
 	 * Note that this means things can change behind our back...
 	 */
 
-	spinlock_release(&kmalloc_spinlock);
+	mcslock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
 		return NULL;
 	}
-	spinlock_acquire(&kmalloc_spinlock);
+	mcslock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
 	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		/* Out of pagerefs; get another page of them, unlocked. */
+		mcslock_release(&kmalloc_spinlock);
+		prrefpage = alloc_kpages(1);
+		if (prrefpage==0) {
+			/* Couldn't allocate accounting space for the new page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+			return NULL;
+		}
+		mcslock_acquire(&kmalloc_spinlock);
+		addpagerefpage(prrefpage);
+		pr = allocpageref();
+		KASSERT(pr != NULL);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -512,84 +640,39 @@ static
 int
 subpage_kfree(void *ptr)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
+	vaddr_t prpage;		// page to hand back, if any
 
-	ptraddr = (vaddr_t)ptr;
-
-	spinlock_acquire(&kmalloc_spinlock);
+	mcslock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_findpage((vaddr_t)ptr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
+		mcslock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
-	offset = ptraddr - prpage;
-
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
-	}
-
 	/*
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
-	fill_deadbeef(ptr, sizes[blktype]);
-
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	fill_deadbeef(ptr, sizes[PR_BLOCKTYPE(pr)]);
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (subpage_putblock(pr, (vaddr_t)ptr, &prpage)) {
 		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
+		mcslock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 	}
 	else {
-		spinlock_release(&kmalloc_spinlock);
+		mcslock_release(&kmalloc_spinlock);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
+	mcslock_acquire(&kmalloc_spinlock);
 	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
+	mcslock_release(&kmalloc_spinlock);
 #endif
 
 	return 0;
@@ -598,37 +681,970 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu keeps, for each block size, a magazine: a small stack
+//    of free blocks it can hand out and take back without touching
+//    kmalloc_spinlock. The only protection a magazine needs is
+//    having interrupts off, since nobody else uses this cpu's
+//    magazines and we can't be switched to another cpu while at
+//    splhigh.
+//
+//    When a magazine runs empty, we refill MAG_BATCH blocks from the
+//    shared pool in one trip through the lock; when it fills up, we
+//    drain the MAG_BATCH oldest blocks back the same way. Only
+//    when the shared pool has nothing of the right size do we fall
+//    back to subpage_kmalloc to make a fresh page.
+//
+//    kfree also has to know the size of a block before it can put
+//    it in the right magazine. Rather than walk the page list under
+//    the lock every time, each cpu remembers the block type of pages
+//    it has recently freed into, along with the pageref it came
+//    from. The hint is good as long as that pageref still says the
+//    same thing: when a page leaves the subpage allocator its
+//    pageref is cleared, and pagerefs are never given back, so
+//    checking costs one unlocked read and no page leaving on
+//    another cpu disturbs hints for the others. (The page of a
+//    block being freed can't leave the allocator underneath us,
+//    since the block isn't free yet, so if its pageref matches now
+//    it keeps matching.)
+//
+//    Blocks sitting in magazines still count as allocated as far as
+//    the pages are concerned, so a page can stay pinned by a few
+//    cached blocks. That's at most MAG_ROUNDS blocks per size per
+//    cpu.
+//
+
+#define MAG_ROUNDS 8
+#define MAG_BATCH  (MAG_ROUNDS/2)
+#define NPAGEHINTS 16
+
+struct magazine {
+	unsigned nrounds;
+	void *rounds[MAG_ROUNDS];
+};
+
+struct pagehint {
+	vaddr_t pageaddr_and_blocktype;
+	struct pageref *pr;		/* where it came from */
+};
+
+struct kmcpu {
+	struct magazine kc_mags[NSIZES];
+	struct pagehint kc_hints[NPAGEHINTS];
+};
+
+static struct kmcpu kmcpus[MAXCPUS];
+
+/*
+ * Print how many blocks each cpu has cached. Blocks in magazines show
+ * up as allocated ('*') in dumpsubpage. The counts for other cpus
+ * can be a little out of date by the time they're printed.
+ */
+static
+void
+dumpmagazines(void)
+{
+	unsigned i, j, n;
+
+	for (i=0; i<MAXCPUS; i++) {
+		n = 0;
+		for (j=0; j<NSIZES; j++) {
+			n += kmcpus[i].kc_mags[j].nrounds;
+		}
+		if (n > 0) {
+			kprintf("cpu%u magazines: %u blocks cached\n", i, n);
+		}
+	}
+}
+
+/*
+ * Get this cpu's caches. Interrupts must be off.
+ */
+static
+struct kmcpu *
+kmcpu_get(void)
+{
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(curcpu->c_number < MAXCPUS);
+	return &kmcpus[curcpu->c_number];
+}
+
+/*
+ * Allocate a block of type BLKTYPE from this cpu's magazine,
+ * refilling it from the shared pool if it's empty. Returns NULL if
+ * the pool has no free blocks of that size either (or if it's too
+ * early in boot to have a curcpu).
+ */
+static
 void *
-kmalloc(size_t sz)
+mag_alloc(unsigned blktype)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
+	struct magazine *mag;
+	struct pageref *pr;
+	void *ptr;
+	int spl;
 
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	mag = &kmcpu_get()->kc_mags[blktype];
+
+	if (mag->nrounds == 0) {
+		mcslock_acquire(&kmalloc_spinlock);
+		checksubpages();
+
+		for (pr = sizebases[blktype];
+		     pr != NULL && mag->nrounds < MAG_BATCH;
+		     pr = pr->next_samesize) {
+			KASSERT(PR_BLOCKTYPE(pr) == blktype);
+			while (pr->nfree > 0 && mag->nrounds < MAG_BATCH) {
+				mag->rounds[mag->nrounds++] =
+					subpage_takeblock(pr);
+			}
 		}
 
-		return (void *)address;
+		checksubpages();
+		mcslock_release(&kmalloc_spinlock);
 	}
 
-	return subpage_kmalloc(sz);
+	ptr = NULL;
+	if (mag->nrounds > 0) {
+		ptr = mag->rounds[--mag->nrounds];
+	}
+
+	splx(spl);
+	return ptr;
 }
 
-void
-kfree(void *ptr)
+/*
+ * Free a block into this cpu's magazine, draining the magazine back
+ * to the shared pool if it's full. Like subpage_kfree, returns -1 if
+ * the block isn't a subpage allocation. The block type is handed
+ * back in *BLKTYPEP for the statistics.
+ */
+static
+int
+mag_free(void *ptr, int *blktypep)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
-	if (ptr == NULL) {
-		return;
-	} else if (subpage_kfree(ptr)) {
-		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
+	vaddr_t ptraddr;	// same as ptr
+	struct kmcpu *kc;	// this cpu's caches
+	struct pagehint *hint;	// hint slot for ptr's page
+	struct magazine *mag;	// magazine for ptr's block type
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t freepages[MAG_BATCH];	// pages emptied by draining
+	unsigned nfreepages, i;
+	int blktype, spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* No statistics this early, so the type doesn't matter */
+		*blktypep = 0;
+		return subpage_kfree(ptr);
 	}
-}
 
+	ptraddr = (vaddr_t)ptr;
+	nfreepages = 0;
+
+	spl = splhigh();
+	kc = kmcpu_get();
+
+	hint = &kc->kc_hints[(ptraddr / PAGE_SIZE) % NPAGEHINTS];
+	if (PR_PAGEADDR(hint) != (ptraddr & PAGE_FRAME) ||
+	    hint->pr == NULL ||
+	    hint->pr->pageaddr_and_blocktype !=
+	    hint->pageaddr_and_blocktype) {
+		mcslock_acquire(&kmalloc_spinlock);
+		pr = subpage_findpage(ptraddr);
+		if (pr == NULL) {
+			/* Not a subpage allocation */
+			mcslock_release(&kmalloc_spinlock);
+			splx(spl);
+			return -1;
+		}
+		hint->pageaddr_and_blocktype = pr->pageaddr_and_blocktype;
+		hint->pr = pr;
+		mcslock_release(&kmalloc_spinlock);
+	}
+
+	blktype = PR_BLOCKTYPE(hint);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	*blktypep = blktype;
+
+	/* Check alignment here; subpage_putblock won't see it until later */
+	if ((ptraddr - PR_PAGEADDR(hint)) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	mag = &kc->kc_mags[blktype];
+	if (mag->nrounds == MAG_ROUNDS) {
+		/* Full; give back the oldest half and keep the warm ones. */
+		mcslock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		for (i=0; i<MAG_BATCH; i++) {
+			pr = subpage_findpage((vaddr_t)mag->rounds[i]);
+			KASSERT(pr != NULL);
+			if (subpage_putblock(pr, (vaddr_t)mag->rounds[i],
+					     &freepages[nfreepages])) {
+				nfreepages++;
+			}
+		}
+		checksubpages();
+		mcslock_release(&kmalloc_spinlock);
+
+		for (i=MAG_BATCH; i<MAG_ROUNDS; i++) {
+			mag->rounds[i - MAG_BATCH] = mag->rounds[i];
+		}
+		mag->nrounds -= MAG_BATCH;
+	}
+	mag->rounds[mag->nrounds++] = ptr;
+
+	splx(spl);
+
+	/* Call free_kpages without kmalloc_spinlock or interrupts off. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Buddy allocator for multi-page blocks.
+//
+//    Allocations of one page up to BIG_MAXPAGES pages are carved out
+//    of arenas of BIG_MAXPAGES contiguous pages got from alloc_kpages.
+//    Within an arena every block is a power of two pages long and
+//    aligned (relative to the arena base) to its own size, so the
+//    buddy of a block is found by flipping one bit of its page
+//    index. Freeing a block merges it with its buddy for as long as
+//    the buddy is free too, so a run of small frees doesn't leave the
+//    arena chopped up.
+//
+//    Each arena keeps a byte per page saying whether a block starts
+//    there, whether it's free, and its order; that's how kfree knows
+//    how big a block is. Free blocks are kept on per-order lists,
+//    linked through their first words.
+//
+//    One wholly free arena is kept around for the next allocation;
+//    any more than that go back to the coremap. Anything bigger than
+//    an arena, or that can't get an arena, goes straight to
+//    alloc_kpages as before.
+//
+
+#define BIG_MAXORDER 4
+#define BIG_MAXPAGES (1 << BIG_MAXORDER)
+
+#define BIG_ORDERMASK 0x0f	/* order of the block starting here */
+#define BIG_FREE      0x10	/* block starting here is free */
+#define BIG_HEAD      0x20	/* a block starts here */
+
+struct bigarena {
+	struct bigarena *ba_next;
+	vaddr_t ba_base;
+	unsigned ba_nfree;		/* free pages in the arena */
+	uint8_t ba_pages[BIG_MAXPAGES];
+};
+
+struct bigfree {
+	struct bigfree *bf_next;
+	struct bigfree *bf_prev;
+};
+
+static struct bigarena *bigarenas;
+static struct bigfree *bigfreelists[BIG_MAXORDER+1];
+static unsigned bigemptyarenas;
+
+/* Protects everything above; separate from kmalloc_spinlock. */
+static struct spinlock big_spinlock = SPINLOCK_INITIALIZER;
+
+static
+unsigned
+big_order(unsigned long npages)
+{
+	unsigned order;
+
+	for (order=0; (1UL << order) < npages; order++);
+	KASSERT(order <= BIG_MAXORDER);
+	return order;
+}
+
+static
+struct bigarena *
+big_findarena(vaddr_t addr)
+{
+	struct bigarena *ba;
+
+	KASSERT(spinlock_do_i_hold(&big_spinlock));
+
+	for (ba = bigarenas; ba != NULL; ba = ba->ba_next) {
+		if (addr >= ba->ba_base &&
+		    addr < ba->ba_base + BIG_MAXPAGES * PAGE_SIZE) {
+			return ba;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+big_push(unsigned order, vaddr_t addr)
+{
+	struct bigfree *bf = (struct bigfree *)addr;
+
+	bf->bf_prev = NULL;
+	bf->bf_next = bigfreelists[order];
+	if (bf->bf_next != NULL) {
+		bf->bf_next->bf_prev = bf;
+	}
+	bigfreelists[order] = bf;
+}
+
+static
+void
+big_remove(unsigned order, vaddr_t addr)
+{
+	struct bigfree *bf = (struct bigfree *)addr;
+
+	if (bf->bf_prev != NULL) {
+		bf->bf_prev->bf_next = bf->bf_next;
+	}
+	else {
+		KASSERT(bigfreelists[order] == bf);
+		bigfreelists[order] = bf->bf_next;
+	}
+	if (bf->bf_next != NULL) {
+		bf->bf_next->bf_prev = bf->bf_prev;
+	}
+}
+
+/*
+ * Get a new arena and put it on the lists as one free block. Called
+ * without big_spinlock; returns with it held. Returns false (without
+ * the lock) if there's no memory.
+ */
+static
+bool
+big_grow(void)
+{
+	struct bigarena *ba;
+	vaddr_t base;
+	unsigned i;
+
+	base = alloc_kpages(BIG_MAXPAGES);
+	if (base == 0) {
+		return false;
+	}
+	ba = kmalloc(sizeof(*ba));
+	if (ba == NULL) {
+		free_kpages(base);
+		return false;
+	}
+
+	ba->ba_base = base;
+	ba->ba_nfree = BIG_MAXPAGES;
+	for (i=0; i<BIG_MAXPAGES; i++) {
+		ba->ba_pages[i] = 0;
+	}
+	ba->ba_pages[0] = BIG_HEAD | BIG_FREE | BIG_MAXORDER;
+
+	spinlock_acquire(&big_spinlock);
+	ba->ba_next = bigarenas;
+	bigarenas = ba;
+	bigemptyarenas++;
+	big_push(BIG_MAXORDER, base);
+	return true;
+}
+
+/*
+ * Allocate NPAGES pages from the arenas. Returns 0 if that can't be
+ * done; the caller should then try alloc_kpages directly.
+ */
+static
+vaddr_t
+big_alloc(unsigned long npages)
+{
+	struct bigarena *ba;
+	unsigned order, k, idx;
+	vaddr_t addr;
+
+	order = big_order(npages);
+
+	spinlock_acquire(&big_spinlock);
+	for (k=order; k<=BIG_MAXORDER && bigfreelists[k]==NULL; k++);
+	if (k > BIG_MAXORDER) {
+		spinlock_release(&big_spinlock);
+		if (!big_grow()) {
+			return 0;
+		}
+		/* Somebody else may have freed something meanwhile. */
+		for (k=order; bigfreelists[k]==NULL; k++);
+	}
+
+	addr = (vaddr_t)bigfreelists[k];
+	big_remove(k, addr);
+	ba = big_findarena(addr);
+	KASSERT(ba != NULL);
+	idx = (addr - ba->ba_base) / PAGE_SIZE;
+	KASSERT(ba->ba_pages[idx] == (BIG_HEAD | BIG_FREE | k));
+	if (k == BIG_MAXORDER) {
+		KASSERT(bigemptyarenas > 0);
+		bigemptyarenas--;
+	}
+
+	/* Split off the upper halves until it's the right size. */
+	while (k > order) {
+		k--;
+		ba->ba_pages[idx + (1 << k)] = BIG_HEAD | BIG_FREE | k;
+		big_push(k, addr + (PAGE_SIZE << k));
+	}
+
+	ba->ba_pages[idx] = BIG_HEAD | order;
+	ba->ba_nfree -= 1 << order;
+
+	spinlock_release(&big_spinlock);
+	return addr;
+}
+
+/*
+ * Free a block from the arenas. Returns -1 if ADDR isn't in one;
+ * otherwise the block's order is handed back in *ORDERP.
+ */
+static
+int
+big_free(vaddr_t addr, unsigned *orderp)
+{
+	struct bigarena *ba, **bap;
+	unsigned order, idx, buddy;
+
+	spinlock_acquire(&big_spinlock);
+
+	ba = big_findarena(addr);
+	if (ba == NULL) {
+		spinlock_release(&big_spinlock);
+		return -1;
+	}
+
+	idx = (addr - ba->ba_base) / PAGE_SIZE;
+	if (addr % PAGE_SIZE != 0 ||
+	    (ba->ba_pages[idx] & (BIG_HEAD | BIG_FREE)) != BIG_HEAD) {
+		panic("kfree: multi-page free of invalid addr %p\n",
+		      (void *)addr);
+	}
+	order = ba->ba_pages[idx] & BIG_ORDERMASK;
+	*orderp = order;
+	ba->ba_pages[idx] = 0;
+	ba->ba_nfree += 1 << order;
+
+	/* Merge with free buddies as far as we can. */
+	while (order < BIG_MAXORDER) {
+		buddy = idx ^ (1 << order);
+		if (ba->ba_pages[buddy] != (BIG_HEAD | BIG_FREE | order)) {
+			break;
+		}
+		big_remove(order, ba->ba_base + buddy * PAGE_SIZE);
+		ba->ba_pages[buddy] = 0;
+		idx &= ~(1 << order);
+		order++;
+	}
+
+	if (order == BIG_MAXORDER) {
+		KASSERT(idx == 0 && ba->ba_nfree == BIG_MAXPAGES);
+		if (bigemptyarenas > 0) {
+			/* Already have a spare; give this one back. */
+			for (bap = &bigarenas; *bap != ba; bap = &(*bap)->ba_next);
+			*bap = ba->ba_next;
+			spinlock_release(&big_spinlock);
+			free_kpages(ba->ba_base);
+			kfree(ba);
+			return 0;
+		}
+		bigemptyarenas++;
+	}
+
+	ba->ba_pages[idx] = BIG_HEAD | BIG_FREE | order;
+	big_push(order, ba->ba_base + idx * PAGE_SIZE);
+
+	spinlock_release(&big_spinlock);
+	return 0;
+}
+
+/*
+ * Print each arena's free page count and block map: one character
+ * per page, the order of the block starting there ('.' if free) or
+ * '-' for pages in the middle of a block.
+ */
+static
+void
+dumpbigarenas(void)
+{
+	struct bigarena *ba;
+	unsigned i;
+	uint8_t st;
+
+	spinlock_acquire(&big_spinlock);
+	kprintf("Multi-page arenas:\n");
+	for (ba = bigarenas; ba != NULL; ba = ba->ba_next) {
+		kprintf("at 0x%08lx: %u/%u pages free  ",
+			(unsigned long)ba->ba_base, ba->ba_nfree, BIG_MAXPAGES);
+		for (i=0; i<BIG_MAXPAGES; i++) {
+			st = ba->ba_pages[i];
+			if (!(st & BIG_HEAD)) {
+				kprintf("-");
+			}
+			else if (st & BIG_FREE) {
+				kprintf(".");
+			}
+			else {
+				kprintf("%u", st & BIG_ORDERMASK);
+			}
+		}
+		kprintf("\n");
+	}
+	spinlock_release(&big_spinlock);
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Heap statistics.
+//
+//    Every kmalloc and kfree is counted against a size class: one
+//    per subpage block size, one per buddy order, and one for
+//    allocations that went straight to alloc_kpages. Every kmalloc
+//    is also charged to its call site (the return address), in a
+//    small hash table. The counters are per-cpu, updated with
+//    interrupts off like the magazines, so keeping them costs no
+//    locking; they're added up when somebody asks.
+//
+//    A block's call site isn't stored with it, so frees can't be
+//    charged back to a site; the site table counts allocations.
+//    Diffing two snapshots shows who has been allocating in between,
+//    and the per-class live counts show whether it was given back.
+//
+//    The high-water mark is the most blocks of a class ever live at
+//    once. Updates from different cpus can race, so with several
+//    cpus allocating at once it can come out a little low.
+//
+//    Direct alloc_kpages allocations can't be sized at kfree time,
+//    so that class only reports counts.
+//
+//    Object caches (kmemcache.c) get their slabs straight from
+//    alloc_kpages, so none of the above sees threads, procs or synch
+//    primitives. Their counts are collected from the caches and
+//    shown alongside.
+//
+//    Wrappers such as kstrdup use kmalloc_caller to pass their own
+//    caller on, so their allocations are charged to the real site.
+//
+
+#define KH_BIGCLASS(order)  (NSIZES + (order))
+#define KH_DIRECT           (NSIZES + BIG_MAXORDER + 1)
+#define KH_NCLASSES         (KH_DIRECT + 1)
+
+#define KH_NSITES   32		/* per cpu */
+#define KH_NMERGED  64		/* in a snapshot */
+#define KH_NCACHES  16		/* object caches in a snapshot */
+
+struct khsite {
+	vaddr_t ks_caller;		/* 0 if slot unused */
+	unsigned ks_allocs;
+	unsigned ks_bytes;		/* bytes asked for */
+};
+
+struct khcpu {
+	unsigned kc_allocs[KH_NCLASSES];
+	unsigned kc_frees[KH_NCLASSES];
+	struct khsite kc_sites[KH_NSITES];
+	struct khsite kc_othersites;	/* when kc_sites is full */
+};
+
+/* Totals over all cpus at one point in time. */
+struct khtotals {
+	unsigned kt_allocs[KH_NCLASSES];
+	unsigned kt_frees[KH_NCLASSES];
+	struct khsite kt_sites[KH_NMERGED];
+	struct khsite kt_othersites;
+	struct kmem_cache_stats kt_caches[KH_NCACHES];
+	unsigned kt_ncaches;
+};
+
+static struct khcpu khcpus[MAXCPUS];
+static unsigned kh_ncpus;		/* 1 + highest cpu number seen */
+static unsigned kh_hwm[KH_NCLASSES];	/* in blocks */
+
+/*
+ * The menu commands run one at a time, so the snapshot and the
+ * scratch totals used for printing can live here rather than on the
+ * (small) kernel stack.
+ */
+static struct khtotals kh_snapshot;
+static bool kh_havesnapshot;
+static struct khtotals kh_now;
+
+static
+size_t
+kh_classsize(unsigned cls)
+{
+	if (cls < NSIZES) {
+		return sizes[cls];
+	}
+	if (cls < KH_DIRECT) {
+		return PAGE_SIZE << (cls - NSIZES);
+	}
+	return 0;
+}
+
+static
+void
+kh_site(struct khcpu *kc, vaddr_t caller, size_t sz)
+{
+	struct khsite *site;
+	unsigned i, slot;
+
+	slot = (caller >> 2) % KH_NSITES;
+	for (i=0; i<KH_NSITES; i++) {
+		site = &kc->kc_sites[(slot + i) % KH_NSITES];
+		if (site->ks_caller == caller || site->ks_caller == 0) {
+			site->ks_caller = caller;
+			site->ks_allocs++;
+			site->ks_bytes += sz;
+			return;
+		}
+	}
+	kc->kc_othersites.ks_allocs++;
+	kc->kc_othersites.ks_bytes += sz;
+}
+
+/*
+ * Count an allocation (CALLER != 0) or a free (CALLER == 0) in
+ * class CLS.
+ */
+static
+void
+kh_count(unsigned cls, vaddr_t caller, size_t sz)
+{
+	struct khcpu *kc;
+	unsigned i, live;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+	KASSERT(cls < KH_NCLASSES);
+
+	spl = splhigh();
+	KASSERT(curcpu->c_number < MAXCPUS);
+	kc = &khcpus[curcpu->c_number];
+	if (curcpu->c_number >= kh_ncpus) {
+		kh_ncpus = curcpu->c_number + 1;
+	}
+
+	if (caller == 0) {
+		kc->kc_frees[cls]++;
+	}
+	else {
+		kc->kc_allocs[cls]++;
+		kh_site(kc, caller, sz);
+
+		/*
+		 * Blocks allocated before curcpu existed were never
+		 * counted, so frees can outnumber allocations.
+		 */
+		live = 0;
+		for (i=0; i<kh_ncpus; i++) {
+			live += khcpus[i].kc_allocs[cls] - khcpus[i].kc_frees[cls];
+		}
+		if ((int)live > 0 && live > kh_hwm[cls]) {
+			kh_hwm[cls] = live;
+		}
+	}
+	splx(spl);
+}
+
+static
+void
+kh_addsite(struct khtotals *kt, const struct khsite *site)
+{
+	unsigned i;
+
+	for (i=0; i<KH_NMERGED; i++) {
+		if (kt->kt_sites[i].ks_caller == site->ks_caller ||
+		    kt->kt_sites[i].ks_caller == 0) {
+			kt->kt_sites[i].ks_caller = site->ks_caller;
+			kt->kt_sites[i].ks_allocs += site->ks_allocs;
+			kt->kt_sites[i].ks_bytes += site->ks_bytes;
+			return;
+		}
+	}
+	kt->kt_othersites.ks_allocs += site->ks_allocs;
+	kt->kt_othersites.ks_bytes += site->ks_bytes;
+}
+
+/*
+ * Add up the per-cpu counters. Other cpus keep going meanwhile, so
+ * this is only a consistent picture if they're idle.
+ */
+static
+void
+kh_gettotals(struct khtotals *kt)
+{
+	unsigned i, j;
+
+	bzero(kt, sizeof(*kt));
+	for (i=0; i<kh_ncpus; i++) {
+		for (j=0; j<KH_NCLASSES; j++) {
+			kt->kt_allocs[j] += khcpus[i].kc_allocs[j];
+			kt->kt_frees[j] += khcpus[i].kc_frees[j];
+		}
+		for (j=0; j<KH_NSITES; j++) {
+			if (khcpus[i].kc_sites[j].ks_caller != 0) {
+				kh_addsite(kt, &khcpus[i].kc_sites[j]);
+			}
+		}
+		kt->kt_othersites.ks_allocs +=
+			khcpus[i].kc_othersites.ks_allocs;
+		kt->kt_othersites.ks_bytes +=
+			khcpus[i].kc_othersites.ks_bytes;
+	}
+	kt->kt_ncaches = kmem_cache_getstats(kt->kt_caches, KH_NCACHES);
+}
+
+static
+const struct kmem_cache_stats *
+kh_findcache(const struct khtotals *kt, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<kt->kt_ncaches; i++) {
+		if (kt->kt_caches[i].kcs_name == name) {
+			return &kt->kt_caches[i];
+		}
+	}
+	return NULL;
+}
+
+static
+const struct khsite *
+kh_findsite(const struct khtotals *kt, vaddr_t caller)
+{
+	unsigned i;
+
+	for (i=0; i<KH_NMERGED; i++) {
+		if (kt->kt_sites[i].ks_caller == caller) {
+			return &kt->kt_sites[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Print the counters in kh_now, less those in BASE if it isn't NULL.
+ * Live counts, high-water marks and slab pages are always absolute.
+ */
+static
+void
+kh_print(const struct khtotals *base)
+{
+	const struct khsite *site, *old;
+	const struct kmem_cache_stats *kcs, *oldkcs;
+	unsigned i, allocs, frees, live, bytes;
+	size_t sz;
+
+	kprintf("class     allocs    frees     live  live bytes  high water\n");
+	for (i=0; i<KH_NCLASSES; i++) {
+		allocs = kh_now.kt_allocs[i];
+		frees = kh_now.kt_frees[i];
+		if (base != NULL) {
+			allocs -= base->kt_allocs[i];
+			frees -= base->kt_frees[i];
+		}
+		if (allocs == 0 && frees == 0 && kh_hwm[i] == 0) {
+			continue;
+		}
+		live = kh_now.kt_allocs[i] - kh_now.kt_frees[i];
+		if ((int)live < 0) {
+			/* more frees than counted allocs; see kh_count */
+			live = 0;
+		}
+		sz = kh_classsize(i);
+		if (sz == 0) {
+			kprintf("direct %9u%9u%9u           -           -\n",
+				allocs, frees, live);
+		}
+		else {
+			kprintf("%6lu %9u%9u%9u%12lu%12lu\n",
+				(unsigned long)sz, allocs, frees, live,
+				(unsigned long)(live * sz),
+				(unsigned long)(kh_hwm[i] * sz));
+		}
+	}
+
+	kprintf("call site       allocs       bytes\n");
+	for (i=0; i<KH_NMERGED; i++) {
+		site = &kh_now.kt_sites[i];
+		if (site->ks_caller == 0) {
+			break;
+		}
+		allocs = site->ks_allocs;
+		bytes = site->ks_bytes;
+		if (base != NULL) {
+			old = kh_findsite(base, site->ks_caller);
+			if (old != NULL) {
+				allocs -= old->ks_allocs;
+				bytes -= old->ks_bytes;
+			}
+		}
+		if (allocs > 0) {
+			kprintf("0x%08lx %12u%12u\n",
+				(unsigned long)site->ks_caller, allocs, bytes);
+		}
+	}
+	allocs = kh_now.kt_othersites.ks_allocs;
+	bytes = kh_now.kt_othersites.ks_bytes;
+	if (base != NULL) {
+		allocs -= base->kt_othersites.ks_allocs;
+		bytes -= base->kt_othersites.ks_bytes;
+	}
+	if (allocs > 0) {
+		kprintf("(other)    %12u%12u\n", allocs, bytes);
+	}
+
+	kprintf("cache               size   allocs    frees");
+	kprintf("     live  slab pages\n");
+	for (i=0; i<kh_now.kt_ncaches; i++) {
+		kcs = &kh_now.kt_caches[i];
+		allocs = kcs->kcs_allocs;
+		frees = kcs->kcs_frees;
+		if (base != NULL) {
+			oldkcs = kh_findcache(base, kcs->kcs_name);
+			if (oldkcs != NULL) {
+				allocs -= oldkcs->kcs_allocs;
+				frees -= oldkcs->kcs_frees;
+			}
+		}
+		kprintf("%-16s %7lu%9u%9u%9u%12u\n", kcs->kcs_name,
+			(unsigned long)kcs->kcs_size, allocs, frees,
+			kcs->kcs_allocs - kcs->kcs_frees, kcs->kcs_slabs);
+	}
+}
+
+/*
+ * Print the counters since boot; part of kheap_printstats.
+ */
+static
+void
+dumpheapstats(void)
+{
+	kprintf("Heap statistics since boot:\n");
+	kh_gettotals(&kh_now);
+	kh_print(NULL);
+}
+
+void
+kheap_snapshot(void)
+{
+	kh_gettotals(&kh_snapshot);
+	kh_havesnapshot = true;
+}
+
+void
+kheap_printdiff(void)
+{
+	kh_gettotals(&kh_now);
+	if (kh_havesnapshot) {
+		kprintf("Heap statistics since last snapshot:\n");
+		kh_print(&kh_snapshot);
+	}
+	else {
+		kprintf("Heap statistics since boot (no snapshot yet):\n");
+		kh_print(NULL);
+	}
+}
+
+//
+////////////////////////////////////////////////////////////
+
+void *
+kmalloc(size_t sz)
+{
+	return kmalloc_caller(sz, (vaddr_t)__builtin_return_address(0));
+}
+
+void *
+kmalloc_caller(size_t sz, vaddr_t caller)
+{
+	unsigned blktype;
+	void *ptr;
+
+	if (sz>=LARGEST_SUBPAGE_SIZE) {
+		unsigned long npages;
+		vaddr_t address;
+
+		/* Round up to a whole number of pages. */
+		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+		if (npages <= BIG_MAXPAGES) {
+			address = big_alloc(npages);
+			if (address != 0) {
+				kh_count(KH_BIGCLASS(big_order(npages)),
+					 caller, sz);
+				return (void *)address;
+			}
+		}
+		address = alloc_kpages(npages);
+		if (address==0) {
+			return NULL;
+		}
+		kh_count(KH_DIRECT, caller, sz);
+
+		return (void *)address;
+	}
+
+	blktype = blocktype(sz);
+	ptr = mag_alloc(blktype);
+	if (ptr == NULL) {
+		ptr = subpage_kmalloc(sz);
+	}
+	if (ptr != NULL) {
+		kh_count(blktype, caller, sz);
+	}
+	return ptr;
+}
+
+void
+kfree(void *ptr)
+{
+	int blktype;
+	unsigned order;
+
+	/*
+	 * Try subpage first, then the multi-page arenas; if both fail,
+	 * assume it came straight from alloc_kpages.
+	 */
+	if (ptr == NULL) {
+		return;
+	} else if (mag_free(ptr, &blktype) == 0) {
+		kh_count(blktype, 0, 0);
+	} else if (big_free((vaddr_t)ptr, &order) == 0) {
+		kh_count(KH_BIGCLASS(order), 0, 0);
+	} else {
+		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+		free_kpages((vaddr_t)ptr);
+		kh_count(KH_DIRECT, 0, 0);
+	}
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See kmemcache.h.
+ *
+ * Each slab is one page from alloc_kpages: a struct kmem_slab header
+ * at the front, then the objects. Every object is followed by a link
+ * word (its "bufctl") that chains it onto the slab's free list, so a
+ * free object's own bytes - its constructed state - are never
+ * touched. The low bit of the link says whether the object has been
+ * constructed yet; fresh slabs start out all unconstructed, so the
+ * constructor only runs for objects that are actually used.
+ *
+ * Slabs with at least one free object are on the cache's kc_slabs
+ * list; full slabs are left off it. Because a slab is exactly one
+ * page, the slab an object belongs to is found by masking its
+ * address.
+ *
+ * Every cache is also on kmem_caches, so the heap statistics can
+ * find them all.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+
+#define KC_ALIGN 8			/* same guarantee as kmalloc */
+#define BUF_CONSTRUCTED 0x1		/* low bit of a bufctl */
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_prev;
+	struct kmem_slab *ks_next;
+	vaddr_t ks_freelist;		/* first free object, or 0 */
+	unsigned ks_nfree;
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size asked for */
+	size_t kc_bufoff;		/* offset of bufctl in each object */
+	size_t kc_stride;		/* object plus bufctl, aligned */
+	unsigned kc_perslab;		/* objects per slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+
+	struct spinlock kc_lock;	/* protects everything below */
+	struct kmem_slab *kc_slabs;	/* slabs with free objects */
+	unsigned kc_nslabs;		/* all slabs, including full ones */
+	unsigned kc_nempty;		/* slabs with nothing allocated */
+	unsigned kc_allocs;		/* statistics */
+	unsigned kc_frees;
+};
+
+#define SLAB_FIRST  ROUNDUP(sizeof(struct kmem_slab), KC_ALIGN)
+#define OBJ_SLAB(obj) ((struct kmem_slab *)((obj) & PAGE_FRAME))
+#define BUFCTL(kc, obj) ((vaddr_t *)((obj) + (kc)->kc_bufoff))
+
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+
+static
+void
+slab_link(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	ks->ks_prev = NULL;
+	ks->ks_next = kc->kc_slabs;
+	if (kc->kc_slabs != NULL) {
+		kc->kc_slabs->ks_prev = ks;
+	}
+	kc->kc_slabs = ks;
+}
+
+static
+void
+slab_unlink(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(kc->kc_slabs == ks);
+		kc->kc_slabs = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_prev = ks->ks_next = NULL;
+}
+
+/*
+ * Get a page and lay out a slab of unconstructed objects in it.
+ * Called without the cache lock.
+ */
+static
+struct kmem_slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page, obj;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	ks = (struct kmem_slab *)page;
+	ks->ks_cache = kc;
+	ks->ks_prev = ks->ks_next = NULL;
+	ks->ks_freelist = 0;
+	ks->ks_nfree = kc->kc_perslab;
+
+	/* Build the list backwards so objects come out in address order. */
+	for (i = kc->kc_perslab; i-- > 0; ) {
+		obj = page + SLAB_FIRST + i * kc->kc_stride;
+		*BUFCTL(kc, obj) = ks->ks_freelist;
+		ks->ks_freelist = obj;
+	}
+	return ks;
+}
+
+/*
+ * Run the destructor on whatever was constructed and give the page
+ * back. The slab must be entirely free and off the cache's list.
+ */
+static
+void
+slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	vaddr_t obj, link;
+
+	KASSERT(ks->ks_nfree == kc->kc_perslab);
+
+	for (obj = ks->ks_freelist; obj != 0; obj = link & ~BUF_CONSTRUCTED) {
+		link = *BUFCTL(kc, obj);
+		if ((link & BUF_CONSTRUCTED) && kc->kc_dtor != NULL) {
+			kc->kc_dtor((void *)obj);
+		}
+	}
+	free_kpages((vaddr_t)ks);
+}
+
+/*
+ * Put an object back on its slab's free list. If that leaves a
+ * second slab with nothing allocated, give it back.
+ */
+static
+void
+buf_put(struct kmem_cache *kc, vaddr_t obj, bool constructed)
+{
+	struct kmem_slab *ks;
+	bool reclaim = false;
+
+	ks = OBJ_SLAB(obj);
+	KASSERT(ks->ks_cache == kc);
+	KASSERT((obj - (vaddr_t)ks - SLAB_FIRST) % kc->kc_stride == 0);
+
+	spinlock_acquire(&kc->kc_lock);
+
+	KASSERT(ks->ks_nfree < kc->kc_perslab);
+	*BUFCTL(kc, obj) = ks->ks_freelist |
+		(constructed ? BUF_CONSTRUCTED : 0);
+	ks->ks_freelist = obj;
+	ks->ks_nfree++;
+	if (constructed) {
+		kc->kc_frees++;
+	}
+	else {
+		/* The constructor failed; it was never handed out. */
+		kc->kc_allocs--;
+	}
+
+	if (ks->ks_nfree == 1) {
+		/* Was full; it has something to offer again. */
+		slab_link(kc, ks);
+	}
+	if (ks->ks_nfree == kc->kc_perslab) {
+		if (kc->kc_nempty > 0) {
+			/* Keep one empty slab around, not more. */
+			slab_unlink(kc, ks);
+			kc->kc_nslabs--;
+			reclaim = true;
+		}
+		else {
+			kc->kc_nempty++;
+		}
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	if (reclaim) {
+		slab_destroy(kc, ks);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(name != NULL);
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_bufoff = ROUNDUP(size, sizeof(vaddr_t));
+	kc->kc_stride = ROUNDUP(kc->kc_bufoff + sizeof(vaddr_t), KC_ALIGN);
+	kc->kc_perslab = (PAGE_SIZE - SLAB_FIRST) / kc->kc_stride;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	/* A cache that can't fit a few objects per page isn't worth it. */
+	if (kc->kc_perslab < 4) {
+		panic("kmem_cache_create: %s: objects of size %lu too big\n",
+		      name, (unsigned long)size);
+	}
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_slabs = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nempty = 0;
+	kc->kc_allocs = 0;
+	kc->kc_frees = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	struct kmem_cache **kcp;
+
+	/* Anything still allocated would be on a slab we're about to free. */
+	KASSERT(kc->kc_nempty == kc->kc_nslabs);
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	while ((ks = kc->kc_slabs) != NULL) {
+		spinlock_acquire(&kc->kc_lock);
+		slab_unlink(kc, ks);
+		spinlock_release(&kc->kc_lock);
+		slab_destroy(kc, ks);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t obj, link;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+
+	if (kc->kc_slabs == NULL) {
+		/* Get the page without the lock; someone may beat us. */
+		spinlock_release(&kc->kc_lock);
+		ks = slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		slab_link(kc, ks);
+		kc->kc_nslabs++;
+		kc->kc_nempty++;
+	}
+
+	ks = kc->kc_slabs;
+	KASSERT(ks->ks_nfree > 0);
+	kc->kc_allocs++;
+	if (ks->ks_nfree == kc->kc_perslab) {
+		KASSERT(kc->kc_nempty > 0);
+		kc->kc_nempty--;
+	}
+
+	obj = ks->ks_freelist;
+	link = *BUFCTL(kc, obj);
+	ks->ks_freelist = link & ~BUF_CONSTRUCTED;
+	ks->ks_nfree--;
+	if (ks->ks_nfree == 0) {
+		slab_unlink(kc, ks);
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	if ((link & BUF_CONSTRUCTED) == 0 && kc->kc_ctor != NULL) {
+		result = kc->kc_ctor((void *)obj);
+		if (result) {
+			/* Put it back still unconstructed. */
+			buf_put(kc, obj, false);
+			return NULL;
+		}
+	}
+
+	return (void *)obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+	buf_put(kc, (vaddr_t)obj, true);
+}
+
+unsigned
+kmem_cache_getstats(struct kmem_cache_stats *stats, unsigned max)
+{
+	struct kmem_cache *kc;
+	unsigned n;
+
+	n = 0;
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL && n < max; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		stats[n].kcs_name = kc->kc_name;
+		stats[n].kcs_size = kc->kc_size;
+		stats[n].kcs_allocs = kc->kc_allocs;
+		stats[n].kcs_frees = kc->kc_frees;
+		stats[n].kcs_slabs = kc->kc_nslabs;
+		spinlock_release(&kc->kc_lock);
+		n++;
+	}
+	spinlock_release(&kmem_caches_lock);
+
+	return n;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Swap space on the raw lhd0 disk. See swapfile.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swapfile.h>
+
+static struct vnode *swapVnode = NULL;
+static struct bitmap *swapMap = NULL;
+static unsigned swapSlots = 0;
+
+/* Protects swapMap. */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	char *path;
+	int result;
+
+	/* vfs_open may destroy the path it is given. */
+	path = kstrdup(SWAP_DEVICE);
+	if (path == NULL) {
+		panic("swap_bootstrap: out of memory\n");
+	}
+	result = vfs_open(path, O_RDWR, 0, &swapVnode);
+	kfree(path);
+	if (result) {
+		kprintf("swap: no %s (%s), swapping disabled\n",
+			SWAP_DEVICE, strerror(result));
+		swapVnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swapVnode, &st);
+	if (result) {
+		panic("swap_bootstrap: stat %s: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	swapSlots = st.st_size / PAGE_SIZE;
+	swapMap = bitmap_create(swapSlots);
+	if (swapMap == NULL) {
+		panic("swap_bootstrap: out of memory\n");
+	}
+
+	kprintf("swap: %u pages on %s\n", swapSlots, SWAP_DEVICE);
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swapMap == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swapMap, slot);
+	spinlock_release(&swap_lock);
+
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(swapMap != NULL);
+	KASSERT(slot < swapSlots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swapMap, slot));
+	bitmap_unmark(swapMap, slot);
+	spinlock_release(&swap_lock);
+}
+
+/* Move one page between SLOT and the frame at PADDR. */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(swapVnode != NULL);
+	KASSERT(slot < swapSlots);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swapVnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swapVnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		kprintf("swap: short %s on slot %u\n",
+			rw == UIO_READ ? "read" : "write", slot);
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_write(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_WRITE);
+}
+
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_READ);
+}